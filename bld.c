@@ -53,6 +53,44 @@ defer:
     return result;
 }
 
+// Builds one of the benchmarks of the hooks, from ./src/<name>.c into ./build/<name>.
+bool build_bench(const char *name) {
+    bool result = true;
+    Noh_Arena arena = noh_arena_init(1 KB);
+
+    char *source_path = noh_arena_sprintf(&arena, "./src/%s.c", name);
+    char *output_path = noh_arena_sprintf(&arena, "./build/%s", name);
+
+    Noh_Cmd cmd = {0};
+    Noh_File_Paths input_paths = {0};
+    noh_da_append(&input_paths, "./src/noh.h");
+    noh_da_append(&input_paths, source_path);
+    noh_da_append(&input_paths, "./src/hooks.c");
+    noh_da_append(&input_paths, "./src/hooks_linux.c");
+    noh_da_append(&input_paths, "./src/hooks.h");
+
+    int needs_rebuild = noh_output_is_older(output_path, input_paths.elems, input_paths.count);
+    if (needs_rebuild < 0) noh_return_defer(false);
+    if (needs_rebuild == 0) {
+        noh_log(NOH_INFO, "Benchmark %s is up to date.", name);
+        noh_return_defer(true);
+    }
+
+    noh_cmd_append(&cmd, "clang");
+    noh_cmd_append(&cmd, "-Wall", "-Wextra", "-O2", "-ggdb");
+    noh_cmd_append(&cmd, "-o", output_path);
+    noh_cmd_append(&cmd, source_path);
+    noh_cmd_append(&cmd, "-lm", "-lpthread");
+
+    if (!noh_cmd_run_sync(cmd)) noh_return_defer(false);
+
+defer:
+    noh_cmd_free(&cmd);
+    noh_da_free(&input_paths);
+    noh_arena_free(&arena);
+    return result;
+}
+
 bool build_raylib() {
     bool result = true;
 
@@ -70,7 +108,9 @@ bool build_raylib() {
         char *source_path = noh_arena_sprintf(&arena, "%s/src/%s.c", RAYLIB_PATH, files[i]);
         char *output_path = noh_arena_sprintf(&arena, "./build/raylib/%s.o", files[i]);
 
-        int needs_rebuild = noh_output_is_older(output_path, &source_path, 1);
+        // The flags below are part of the input too, raylib is rebuilt when they change.
+        char *inputs[] = { source_path, "./bld.c" };
+        int needs_rebuild = noh_output_is_older(output_path, inputs, noh_array_len(inputs));
         if (needs_rebuild < 0) noh_return_defer(false);
         if (needs_rebuild == 0) continue;
 
@@ -79,6 +119,8 @@ bool build_raylib() {
         noh_cmd_append(&cmd, "clang");
         noh_cmd_append(&cmd, "-Wno-everything"); // We don't care about warnings in the raylib source.
         noh_cmd_append(&cmd, "-ggdb", "-DPLATFORM_DESKTOP");
+        // NohBoard swaps the buffers, paces the frames and polls for events itself, see the main loop.
+        noh_cmd_append(&cmd, "-DSUPPORT_CUSTOM_FRAME_CONTROL");
         char *glfw_include_path = noh_arena_sprintf(&arena, "-I%/src/external/glfw/include", RAYLIB_PATH);
         noh_cmd_append(&cmd, glfw_include_path);
         noh_cmd_append(&cmd, "-c", source_path);
@@ -119,6 +161,8 @@ void print_usage(char *program) {
     noh_log(NOH_INFO, "Available commands:");
     noh_log(NOH_INFO, "- build: build NohBoard (default).");
     noh_log(NOH_INFO, "- run: build and run NohBoard.");
+    noh_log(NOH_INFO, "- bench: build and run the benchmark of the input backends.");
+    noh_log(NOH_INFO, "- bench-scaling [options]: build and run the benchmark of scaling to many devices.");
     noh_log(NOH_INFO, "- clean: clean all build artifacts.");
 }
 
@@ -162,6 +206,25 @@ int main(int argc, char **argv) {
         if (!noh_cmd_run_sync(cmd)) return 1;
         noh_cmd_free(&cmd);
 
+    } else if (strcmp(command, "bench") == 0) {
+        // Build and run the benchmark.
+        if (!build_bench("bench_hooks")) return 1;
+
+        Noh_Cmd cmd = {0};
+        noh_cmd_append(&cmd, "./build/bench_hooks");
+        if (!noh_cmd_run_sync(cmd)) return 1;
+        noh_cmd_free(&cmd);
+
+    } else if (strcmp(command, "bench-scaling") == 0) {
+        // Build and run the scaling benchmark, passing on its options.
+        if (!build_bench("bench_scaling")) return 1;
+
+        Noh_Cmd cmd = {0};
+        noh_cmd_append(&cmd, "./build/bench_scaling");
+        while (argc > 0) noh_cmd_append(&cmd, noh_shift_args(&argc, &argv));
+        if (!noh_cmd_run_sync(cmd)) return 1;
+        noh_cmd_free(&cmd);
+
     } else if (strcmp(command, "clean") == 0) {
         Noh_Cmd cmd = {0};
         noh_cmd_append(&cmd, "rm", "-rf", "./build/");
@@ -0,0 +1,182 @@
+// Measures how much CPU time the run thread spends per million input events, for every backend that reads the
+// devices. Fake mice stand in for the devices, a writer thread fills them with frames of relative mouse movement, and
+// the main thread takes the place of the state thread by draining the event ring.
+//
+// Build and run with: ./build.sh bench
+
+#define _GNU_SOURCE
+#include <sched.h>
+
+#include "hooks_linux.c"
+
+#define NOH_IMPLEMENTATION
+#include "noh.h"
+
+// The number of events written per run, including the SYN_REPORT that ends every frame.
+#define BENCH_EVENTS (3 * 1000 * 1000)
+
+// The number of frames that is written to a pipe at once.
+#define BENCH_FRAMES_PER_WRITE 16
+
+// The events of one frame, as a mouse reports them.
+#define BENCH_EVENTS_PER_FRAME 3
+
+typedef struct {
+    size_t device_count;
+
+    _Atomic size_t received; // The number of events taken from the event ring so far.
+} Bench_Writer;
+
+// Writes frames to all devices in turn, until BENCH_EVENTS events have been written.
+static void *bench_write(void *arg) {
+    Bench_Writer *writer = arg;
+
+    size_t written = 0;
+    for (size_t device = 0; written < BENCH_EVENTS; device = (device + 1) % writer->device_count) {
+        // Don't get so far ahead that the event ring overflows, that measures resyncing instead of reading. Only the
+        // relative events are passed on.
+        size_t passed_on = written / BENCH_EVENTS_PER_FRAME * (BENCH_EVENTS_PER_FRAME - 1);
+        while (passed_on - atomic_load(&writer->received) > HOOKS_RING_CAPACITY / 2) sched_yield();
+
+        // Timestamping overwrites the events, so every write gets its own frames.
+        Input_Event frames[BENCH_FRAMES_PER_WRITE * BENCH_EVENTS_PER_FRAME] = {0};
+        for (size_t i = 0; i < BENCH_FRAMES_PER_WRITE; i++) {
+            frames[i * BENCH_EVENTS_PER_FRAME + 0] = (Input_Event){ .type = EV_REL, .code = REL_X, .value = 1 };
+            frames[i * BENCH_EVENTS_PER_FRAME + 1] = (Input_Event){ .type = EV_REL, .code = REL_Y, .value = -1 };
+            frames[i * BENCH_EVENTS_PER_FRAME + 2] = (Input_Event){ .type = EV_SYN, .code = SYN_REPORT };
+        }
+
+        if (!fake_device_write(device, frames, noh_array_len(frames))) {
+            noh_log(NOH_ERROR, "Failed writing benchmark events.");
+            break;
+        }
+        written += noh_array_len(frames);
+    }
+
+    return NULL;
+}
+
+// Returns the CPU time in nanoseconds that a thread used so far.
+static int64 bench_thread_time(pthread_t thread) {
+    clockid_t clock;
+    struct timespec time;
+    if (pthread_getcpuclockid(thread, &clock) != 0 || clock_gettime(clock, &time) != 0) return -1;
+    return (int64)time.tv_sec * 1000 * 1000 * 1000 + time.tv_nsec;
+}
+
+// Returns whether the sockets of all devices were read empty.
+static bool bench_devices_empty(NB_Input_Devices *devices) {
+    for (size_t i = 0; i < devices->count; i++) {
+        int available = 0;
+        if (ioctl(devices->elems[i].fd, FIONREAD, &available) < 0 || available > 0) return false;
+    }
+    return true;
+}
+
+// Defines the fake mice the benchmark writes to.
+static void bench_define_mice(size_t device_count) {
+    fake_devices_clear();
+
+    for (size_t i = 0; i < device_count; i++) {
+        Hooks_Device_Description mouse = {0};
+        snprintf(mouse.name, sizeof(mouse.name), "Bench mouse %zu", i);
+        snprintf(mouse.phys, sizeof(mouse.phys), "bench/input%zu", i);
+        snprintf(mouse.path, sizeof(mouse.path), "/dev/input/bench%zu", i);
+
+        mouse.ev_bits[EV_SYN / 8] |= 1 << (EV_SYN % 8);
+        mouse.ev_bits[EV_KEY / 8] |= 1 << (EV_KEY % 8);
+        mouse.ev_bits[EV_REL / 8] |= 1 << (EV_REL % 8);
+        mouse.key_bits[BTN_LEFT / 8] |= 1 << (BTN_LEFT % 8);
+        mouse.rel_bits[REL_X / 8] |= 1 << (REL_X % 8);
+        mouse.rel_bits[REL_Y / 8] |= 1 << (REL_Y % 8);
+
+        fake_device_define(&mouse);
+    }
+}
+
+// Runs the benchmark for one backend and number of devices.
+static bool bench_backend(NB_Hooks_Backend backend, size_t device_count) {
+    bool result = true;
+    Noh_Arena arena = noh_arena_init(4 KB);
+
+    // Only the devices of the fake source are created, the run thread is started without the rest of the hooks.
+    hooks_source = &fake_source;
+    hooks_devices.count = 0;
+    bench_define_mice(device_count);
+    hooks_ring_initialize(&event_ring, HOOKS_RING_CAPACITY);
+    state_fd = eventfd(0, EFD_CLOEXEC);
+    if (!init_fake_devices(&arena, &hooks_devices)) noh_return_defer(false);
+
+    running = true;
+    if (!start_run_thread(&hooks_devices, backend)) {
+        noh_log(NOH_ERROR, "Could not start the %s backend.", backend == NB_Backend_Epoll ? "epoll" : "io_uring");
+        noh_return_defer(false);
+    }
+
+    int64 start_time = noh_get_monotonic_ns();
+    int64 start_cpu = bench_thread_time(run_thread);
+
+    Bench_Writer writer = { .device_count = device_count, .received = 0 };
+    pthread_t writer_thread;
+    pthread_create(&writer_thread, NULL, bench_write, &writer);
+
+    // Drain the ring until the writer is done and everything was read, without applying the events.
+    size_t received = 0;
+    bool writing = true;
+    while (true) {
+        size_t head = atomic_load_explicit(&event_ring.head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&event_ring.tail, memory_order_acquire);
+        received += tail - head;
+        atomic_store_explicit(&event_ring.head, tail, memory_order_release);
+        atomic_store(&writer.received, received);
+
+        if (writing && pthread_tryjoin_np(writer_thread, NULL) == 0) writing = false;
+        if (!writing && bench_devices_empty(&hooks_devices)) break;
+
+        struct pollfd fd = { .fd = state_fd, .events = POLLIN };
+        if (poll(&fd, 1, 1) > 0) {
+            uint64_t counter;
+            (void)!read(state_fd, &counter, sizeof(counter));
+        }
+    }
+
+    int64 cpu = bench_thread_time(run_thread) - start_cpu;
+    int64 elapsed = noh_get_monotonic_ns() - start_time;
+    size_t overflows = atomic_load_explicit(&event_ring.overflows, memory_order_relaxed);
+
+    // Nanoseconds per event is the same as milliseconds per million events.
+    noh_log(NOH_INFO, "%-8s %3zu devices: %7.2f ms CPU per million events, %zu events received in %.2f s, %zu overflows",
+            hooks_backend == NB_Backend_Epoll ? "epoll" : "io_uring", device_count, (double)cpu / BENCH_EVENTS,
+            received, (double)elapsed / 1000 / 1000 / 1000, overflows);
+
+    running = false;
+    uint64_t wakeup = 1;
+    (void)!write(wake_fd, &wakeup, sizeof(wakeup));
+    pthread_join(run_thread, NULL);
+
+defer:
+    close_devices(&hooks_devices);
+    free_described_devices();
+    hooks_ring_free(&event_ring);
+    close(state_fd);
+    noh_arena_free(&arena);
+    return result;
+}
+
+int main(void) {
+    event_batches = calloc(NBI_MAX_DEVICES, sizeof(Input_Event_Batch));
+    noh_assert(event_batches != NULL && "Could not allocate enough memory");
+
+    size_t device_counts[] = { 1, 8, 64 };
+    NB_Hooks_Backend backends[] = { NB_Backend_Epoll, NB_Backend_Io_Uring };
+
+    for (size_t i = 0; i < noh_array_len(device_counts); i++) {
+        for (size_t j = 0; j < noh_array_len(backends); j++) {
+            if (!bench_backend(backends[j], device_counts[i])) return 1;
+        }
+    }
+
+    fake_devices_clear();
+    noh_da_free(&hooks_devices);
+    return 0;
+}
@@ -0,0 +1,267 @@
+// Measures how the hooks scale with the number of devices. Fake mice stand in for the devices, a writer thread sends a
+// frame of relative movement to every one of them at a fixed rate, and the main thread reads the state the way the
+// render loop does. Reports the CPU time the run and state threads spend per event, how many events made it through,
+// and what reading and publishing the state costs. The scheduling options of the hooks can be passed along, to see how
+// they change the jitter of the run thread.
+//
+// Build and run with: ./build.sh bench-scaling [--devices 1,4,16,64,256] [--rate 1000] [--seconds 3]
+
+#define _GNU_SOURCE
+
+#include "hooks_linux.c"
+
+#define NOH_IMPLEMENTATION
+#include "noh.h"
+
+// The events of one frame, as a mouse reports them.
+#define BENCH_EVENTS_PER_FRAME 3
+
+// How often the main thread reads the state, like a render loop at 1000 frames per second.
+#define BENCH_READ_INTERVAL (1000 * 1000)
+
+// The number of times publishing a snapshot is timed, after the hooks stopped.
+#define BENCH_PUBLISHES 1000
+
+typedef struct {
+    size_t device_count;
+    int64 rate; // The number of frames per second that is written to every device.
+    int64 end_time; // The monotonic time in nanoseconds at which to stop writing.
+
+    size_t frames; // The number of frames written to every device, set once the writer is done.
+} Bench_Writer;
+
+// Writes a frame to every device at the rate of the writer, until its end time.
+static void *bench_write(void *arg) {
+    Bench_Writer *writer = arg;
+
+    int64 period = 1000 * 1000 * 1000 / writer->rate;
+    int64 next = noh_get_monotonic_ns();
+    while (next < writer->end_time) {
+        for (size_t i = 0; i < writer->device_count; i++) {
+            // Timestamping overwrites the events, so every write gets its own frame.
+            Input_Event frame[BENCH_EVENTS_PER_FRAME] = {
+                { .type = EV_REL, .code = REL_X, .value = 1 },
+                { .type = EV_REL, .code = REL_Y, .value = -1 },
+                { .type = EV_SYN, .code = SYN_REPORT },
+            };
+            if (!fake_device_write(i, frame, BENCH_EVENTS_PER_FRAME)) return NULL;
+        }
+        writer->frames++;
+
+        // Frames that are due already are skipped rather than sent in a burst, like a device that is not being read.
+        next += period;
+        int64 now = noh_get_monotonic_ns();
+        if (next < now) next += (now - next) / period * period + period;
+
+        struct timespec until = { .tv_sec = next / (1000 * 1000 * 1000), .tv_nsec = next % (1000 * 1000 * 1000) };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR);
+    }
+
+    return NULL;
+}
+
+// Returns the CPU time in nanoseconds that a thread used so far.
+static int64 bench_thread_time(pthread_t thread) {
+    clockid_t clock;
+    struct timespec time;
+    if (pthread_getcpuclockid(thread, &clock) != 0 || clock_gettime(clock, &time) != 0) return -1;
+    return (int64)time.tv_sec * 1000 * 1000 * 1000 + time.tv_nsec;
+}
+
+// Returns the average of a total over a count, or 0 if the count is 0.
+static double bench_average(int64 total, size_t count) {
+    return count > 0 ? (double)total / count : 0;
+}
+
+// Returns whether the sockets of all devices were read empty.
+static bool bench_devices_empty(NB_Input_Devices *devices) {
+    for (size_t i = 0; i < devices->count; i++) {
+        int available = 0;
+        if (ioctl(devices->elems[i].fd, FIONREAD, &available) < 0 || available > 0) return false;
+    }
+    return true;
+}
+
+// Defines the fake mice the benchmark writes to.
+static void bench_define_mice(size_t device_count) {
+    fake_devices_clear();
+
+    for (size_t i = 0; i < device_count; i++) {
+        Hooks_Device_Description mouse = {0};
+        snprintf(mouse.name, sizeof(mouse.name), "Bench mouse %zu", i);
+        snprintf(mouse.phys, sizeof(mouse.phys), "bench/input%zu", i);
+        snprintf(mouse.path, sizeof(mouse.path), "/dev/input/bench%zu", i);
+
+        mouse.ev_bits[EV_SYN / 8] |= 1 << (EV_SYN % 8);
+        mouse.ev_bits[EV_KEY / 8] |= 1 << (EV_KEY % 8);
+        mouse.ev_bits[EV_REL / 8] |= 1 << (EV_REL % 8);
+        mouse.key_bits[BTN_LEFT / 8] |= 1 << (BTN_LEFT % 8);
+        mouse.rel_bits[REL_X / 8] |= 1 << (REL_X % 8);
+        mouse.rel_bits[REL_Y / 8] |= 1 << (REL_Y % 8);
+
+        fake_device_define(&mouse);
+    }
+}
+
+// Runs the benchmark for one number of devices.
+static bool bench_devices(NB_Hooks_Config config, size_t device_count, int64 rate, double seconds) {
+    bench_define_mice(device_count);
+    if (!hooks_initialize_fake(config)) return false;
+    atomic_store(&snapshots.read_retries, 0);
+
+    int64 start_time = noh_get_monotonic_ns();
+    int64 start_run_cpu = bench_thread_time(run_thread);
+    int64 start_state_cpu = bench_thread_time(state_thread);
+
+    Bench_Writer writer = {
+        .device_count = device_count,
+        .rate = rate,
+        .end_time = start_time + (int64)(seconds * 1000 * 1000 * 1000),
+    };
+    pthread_t writer_thread;
+    pthread_create(&writer_thread, NULL, bench_write, &writer);
+
+    // Read the state like the render loop does, until the writer is done and everything was read.
+    Noh_Arena arena = noh_arena_init(1 MB);
+    size_t reads = 0;
+    int64 read_time = 0;
+    bool writing = true;
+    while (writing || !bench_devices_empty(&hooks_devices)) {
+        int64 read_start = noh_get_monotonic_ns();
+        hooks_get_state(&arena);
+        read_time += noh_get_monotonic_ns() - read_start;
+        reads++;
+        noh_arena_reset(&arena);
+
+        if (writing && pthread_tryjoin_np(writer_thread, NULL) == 0) writing = false;
+
+        struct timespec interval = { .tv_nsec = BENCH_READ_INTERVAL };
+        nanosleep(&interval, NULL);
+    }
+
+    // Give the state thread a moment to apply the last events.
+    struct timespec settle = { .tv_nsec = 10 * 1000 * 1000 };
+    nanosleep(&settle, NULL);
+
+    int64 elapsed = noh_get_monotonic_ns() - start_time;
+    int64 run_cpu = bench_thread_time(run_thread) - start_run_cpu;
+    int64 state_cpu = bench_thread_time(state_thread) - start_state_cpu;
+
+    // Only the relative events are passed on, the frames end with a SYN_REPORT.
+    size_t written = writer.frames * device_count * BENCH_EVENTS_PER_FRAME;
+    size_t passed_on = writer.frames * device_count * (BENCH_EVENTS_PER_FRAME - 1);
+    size_t delivered = atomic_load(&event_ring.tail);
+    size_t overflows = atomic_load(&event_ring.overflows);
+    size_t retries = atomic_load(&snapshots.read_retries);
+    size_t snapshot_size = atomic_load(&snapshots.buffers[atomic_load(&snapshots.latest)].size);
+    NB_Hooks_Jitter jitter = hooks_get_jitter();
+
+    hooks_shutdown();
+
+    // With the state thread stopped, the snapshots can be published from here.
+    int64 publish_start = noh_get_monotonic_ns();
+    for (size_t i = 0; i < BENCH_PUBLISHES; i++) hooks_publish_snapshot(&snapshots, &input_state, 0);
+    int64 publish_time = noh_get_monotonic_ns() - publish_start;
+
+    noh_log(NOH_INFO, "%3zu devices: %zu events written in %.2f s, %zu of %zu passed on, %zu overflows", device_count,
+            written, (double)elapsed / 1000 / 1000 / 1000, delivered, passed_on, overflows);
+    noh_log(NOH_INFO, "             run thread %.0f ns CPU per event, state thread %.0f ns CPU per event",
+            bench_average(run_cpu, written), bench_average(state_cpu, delivered));
+    noh_log(NOH_INFO, "             snapshot of %zu bytes, read in %.2f us with %zu retries in %zu reads, "
+            "published in %.2f us", snapshot_size, bench_average(read_time, reads) / 1000, retries, reads,
+            (double)publish_time / BENCH_PUBLISHES / 1000);
+    noh_log(NOH_INFO, "             %zu frames read %.0f us after they arrived at p50, %.0f us at p99, %.0f us at most",
+            jitter.count, jitter.p50, jitter.p99, jitter.max);
+
+    noh_arena_free(&arena);
+    return true;
+}
+
+// Parses a comma separated list of device counts. Returns false if it is not valid.
+static bool bench_parse_counts(char *list, size_t *counts, size_t *count) {
+    *count = 0;
+    for (char *part = strtok(list, ","); part != NULL; part = strtok(NULL, ",")) {
+        char *end;
+        long value = strtol(part, &end, 10);
+        if (*end != '\0' || value <= 0 || *count >= NBI_MAX_DEVICES) return false;
+
+        if (value > NBI_MAX_DEVICES) {
+            noh_log(NOH_WARNING, "Benchmarking %d devices instead of %ld, the hooks support no more.",
+                    NBI_MAX_DEVICES, value);
+            value = NBI_MAX_DEVICES;
+        }
+        counts[(*count)++] = value;
+    }
+    return *count > 0;
+}
+
+// Parses a mask of CPUs, in decimal or hexadecimal with 0x. Returns false if it is not valid.
+static bool bench_parse_cpus(const char *value, uint64 *cpus) {
+    char *end;
+    errno = 0;
+    *cpus = strtoull(value, &end, 0);
+    return errno == 0 && *end == '\0' && end != value;
+}
+
+static void print_usage(char *program) {
+    noh_log(NOH_INFO, "Usage: %s [--devices <n,...>] [--rate <hz>] [--seconds <s>] [--realtime <fifo|rr>] "
+            "[--priority <n>] [--run-cpus <mask>] [--state-cpus <mask>] [--lock-memory]", program);
+    noh_log(NOH_INFO, "- --devices: the numbers of devices to benchmark, 1,4,16,64,256 by default.");
+    noh_log(NOH_INFO, "- --rate: the number of frames every device sends per second, 1000 by default.");
+    noh_log(NOH_INFO, "- --seconds: how long to write to the devices for every number of devices, 3 by default.");
+    noh_log(NOH_INFO, "- --realtime: read the devices in a real-time thread, with the lowest priority by default.");
+    noh_log(NOH_INFO, "- --priority: the real-time priority of the run thread, from 1 to 99.");
+    noh_log(NOH_INFO, "- --run-cpus, --state-cpus: the CPUs the run and state threads may run on, as a mask.");
+    noh_log(NOH_INFO, "- --lock-memory: lock all memory of the process.");
+}
+
+int main(int argc, char **argv) {
+    char *program = noh_shift_args(&argc, &argv);
+
+    size_t counts[NBI_MAX_DEVICES] = { 1, 4, 16, 64, 256 };
+    size_t count = 5;
+    int64 rate = 1000;
+    double seconds = 3;
+    NB_Hooks_Config config = {0};
+
+    while (argc > 0) {
+        char *arg = noh_shift_args(&argc, &argv);
+        if (strcmp(arg, "--lock-memory") == 0) {
+            config.lock_memory = true;
+            continue;
+        }
+
+        char *value = argc > 0 ? noh_shift_args(&argc, &argv) : NULL;
+        if (strcmp(arg, "--devices") == 0 && value != NULL) {
+            if (!bench_parse_counts(value, counts, &count)) {
+                noh_log(NOH_ERROR, "Invalid device counts.");
+                return 1;
+            }
+        } else if (strcmp(arg, "--rate") == 0 && value != NULL && atoll(value) > 0) {
+            rate = atoll(value);
+        } else if (strcmp(arg, "--seconds") == 0 && value != NULL && atof(value) > 0) {
+            seconds = atof(value);
+        } else if (strcmp(arg, "--realtime") == 0 && value != NULL && strcmp(value, "fifo") == 0) {
+            config.run_scheduling = NB_Scheduling_Fifo;
+        } else if (strcmp(arg, "--realtime") == 0 && value != NULL && strcmp(value, "rr") == 0) {
+            config.run_scheduling = NB_Scheduling_Round_Robin;
+        } else if (strcmp(arg, "--priority") == 0 && value != NULL && atoi(value) > 0) {
+            config.run_priority = atoi(value);
+        } else if ((strcmp(arg, "--run-cpus") == 0 || strcmp(arg, "--state-cpus") == 0) && value != NULL) {
+            if (!bench_parse_cpus(value, strcmp(arg, "--run-cpus") == 0 ? &config.run_cpus : &config.state_cpus)) {
+                noh_log(NOH_ERROR, "Invalid CPU mask.");
+                return 1;
+            }
+        } else {
+            print_usage(program);
+            return 1;
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (!bench_devices(config, counts[i], rate, seconds)) return 1;
+    }
+
+    fake_devices_clear();
+    return 0;
+}
@@ -1,14 +1,54 @@
+#include <stdatomic.h>
+#include <math.h>
+#include <limits.h>
+
 #include "noh.h"
 #include "hooks.h"
 
 // Internal representations of NBI_Input_state, using dynamic arrays.
 
+// The number of distinct key codes, the same as KEY_CNT on Linux.
+#define NBI_KEY_CODES 0x300
+
+// The number of 64 bit words needed to hold a bit for every key code.
+#define NBI_KEY_WORDS (NBI_KEY_CODES / 64)
+
+// The number of buckets of the sliding window that key presses per second are counted over, and the width of a bucket
+// in milliseconds. Together they make up one second.
+#define NBI_KPS_BUCKETS 10
+#define NBI_KPS_BUCKET_MS 100
+
+// The statistics of the keys of a device, updated in constant time for every key press and release.
+typedef struct {
+    // Every key that was pressed at least once, in the order of the first press, so a snapshot copies them at once.
+    NB_Key_Stats *elems;
+    size_t count;
+    size_t capacity;
+
+    uint16 slots[NBI_KEY_CODES]; // For every key code, its index in elems plus one, or 0 if it was never pressed.
+    uint64 presses; // The number of key presses on the device.
+
+    // The key presses per bucket, a ring in which the newest bucket is at newest_bucket % NBI_KPS_BUCKETS.
+    uint32 buckets[NBI_KPS_BUCKETS];
+    int64 newest_bucket; // The number of the newest bucket, as the monotonic time divided by the bucket width.
+    uint32 window_presses; // The sum of all buckets, the presses in the last second.
+} NBI_Key_Stats;
+
 typedef struct {
+    // The key codes of the pressed keys, in the order they were pressed. Released keys are replaced by 0 (which is
+    // never a valid key code) so releasing a key does not need to move the other keys. They are removed when the list
+    // is compacted.
     uint16 *elems;
     size_t count;
     size_t capacity;
 
+    size_t pressed_count; // The number of keys that are actually pressed, elems without the released keys.
+    uint64 pressed[NBI_KEY_WORDS]; // A bit for every key code, set if the key is pressed.
+    uint16 positions[NBI_KEY_CODES]; // For every pressed key, its index in elems.
+
     size_t device_index;
+
+    NBI_Key_Stats stats;
 } NBI_Pressed_Keys_List;
 
 typedef struct {
@@ -25,7 +65,7 @@ typedef struct {
 
     int current_value;
     // The time at which the last update was peformed, used to determine the speed from the difference in value,
-    // compared to to difference in time.
+    // compared to to difference in time. Always from the monotonic clock.
     struct timespec last_updated_at;
 
     int min;
@@ -34,6 +74,10 @@ typedef struct {
 
     size_t device_index;
     uint16 axis_id;
+
+    // The monotonic time in nanoseconds at which the next 0 should be pushed into the history, or 0 if the history
+    // is at rest and does not need to decay.
+    int64 decay_at;
 } NBI_Axis_History;
 
 typedef struct {
@@ -42,70 +86,203 @@ typedef struct {
     size_t capacity;
 } NBI_Axis_Histories;
 
+// The time at which an axis history should decay next.
+typedef struct {
+    int64 deadline;
+    size_t axis; // The index of the axis history in the input state.
+} NBI_Axis_Deadline;
+
+// A min-heap of axis deadlines, ordered by deadline.
+typedef struct {
+    NBI_Axis_Deadline *elems;
+    size_t count;
+    size_t capacity;
+} NBI_Axis_Deadlines;
+
+// The interval in milliseconds after which an axis that was not updated decays, by pushing a 0 into its history.
+#define NBI_SMOOTH_INTERVAL 100
+
+// The kind of gesture that the fingers currently on a touch device are making.
+typedef enum {
+    NBI_Gesture_None, // Not moved enough to tell yet.
+    NBI_Gesture_Swipe,
+    NBI_Gesture_Pinch
+} NBI_Gesture_Kind;
+
+// The state of the gesture recognizer of a touch device. Sums over all active contacts are kept up to date as the
+// contacts change, so the center and spread of the fingers are known in constant time for every frame.
+typedef struct {
+    size_t active; // The number of slots with a contact.
+    int64 sum_x;
+    int64 sum_y;
+    int64 sum_squares; // The sum of x * x + y * y over the contacts.
+
+    size_t fingers; // The number of fingers in the last frame, 0 if no gesture is in progress.
+    size_t max_fingers; // The maximum number of fingers since the first finger touched.
+    struct timespec started_at; // When the first finger touched.
+    NBI_Gesture_Kind kind;
+
+    // Where the fingers were in the last frame.
+    double center_x;
+    double center_y;
+    double spread;
+
+    // The total movement and spread change since the gesture started.
+    double moved;
+    double spread_changed;
+
+    // What was left after rounding the values pushed into the gesture axes, added to the next values so slow movement
+    // adds up instead of being rounded to 0 every frame.
+    double remainder_x;
+    double remainder_y;
+    double remainder_spread;
+} NBI_Gesture;
+
+typedef struct {
+    // The slots are stored in a single allocation, tracking_ids points at its start.
+    int *tracking_ids;
+    int *x;
+    int *y;
+    size_t count;
+
+    size_t current_slot; // The slot the next touch events apply to. Events for a slot at or above count are ignored.
+    NBI_Gesture gesture;
+
+    int min_x;
+    int max_x;
+    int min_y;
+    int max_y;
+
+    size_t device_index;
+} NBI_Touch_Contacts;
+
+typedef struct {
+    NBI_Touch_Contacts *elems;
+    size_t count;
+    size_t capacity;
+} NBI_Touch_Contacts_Lists;
+
+// The maximum number of slots that is tracked for a single multi-touch device.
+#define NBI_MAX_TOUCH_SLOTS 64
+
+// The number of distinct absolute and relative axis codes, the same as ABS_CNT and REL_CNT on Linux.
+#define NBI_ABS_CODES 0x40
+#define NBI_REL_CODES 0x10
+
+// The maximum number of devices that can be known at the same time.
+#define NBI_MAX_DEVICES 256
+
+// Where the events of a single device should go. Every entry is the index of the target list in the input state plus
+// one, so 0 means the device has no such list.
+typedef struct {
+    uint32 key_list;
+    uint32 touches;
+    uint32 abs_axes[NBI_ABS_CODES];
+    uint32 rel_axes[NBI_REL_CODES];
+    uint32 gesture_axes[NB_GESTURE_AXES];
+} NBI_Device_Routes;
+
 typedef struct {
     NBI_Pressed_Keys_Lists pressed_keys;
     NBI_Axis_Histories axes;
+    NBI_Touch_Contacts_Lists touches;
+
+    // The routes of every device, indexed by device index. Only built for the state that receives events, using
+    // hooks_build_routes, after the lists are defined.
+    NBI_Device_Routes *routes;
+
+    // Every axis history with a decay_at has exactly one deadline in here, which is at most its decay_at.
+    NBI_Axis_Deadlines decay_deadlines;
+
+    // The monotonic time in nanoseconds of the earliest event applied since the last published snapshot, 0 if none.
+    int64 pending_input_time;
 } NBI_Input_State;
 
-// Copy the data from an NBI_Input_State to an NB_Input_State, using data from the provided arena.
-// Execute this function in a mutex that prevents modification of state, since it assumes this data to be static.
-NB_Input_State copy_nbi_state_to_nb_state(Noh_Arena *arena, NBI_Input_State *state) {
-    // Determine the space needed.
-    size_t needed_space = 0;
-    size_t no_keys_lists = 0;
-    size_t no_axes = 0;
+// Frees the lists of a pressed keys list.
+void hooks_free_key_list(NBI_Pressed_Keys_List *list) {
+    noh_da_free(list);
+    noh_da_free(&list->stats);
+}
+
+// Frees all lists in an input state.
+void hooks_free_state(NBI_Input_State *state) {
+    for (size_t i = 0; i < state->pressed_keys.count; i++) hooks_free_key_list(&state->pressed_keys.elems[i]);
+    noh_da_free(&state->pressed_keys);
 
-    // Space for pressed keys.
-    for (size_t i = 0; i < state->pressed_keys.count; i++) {
-        NBI_Pressed_Keys_List *list = &state->pressed_keys.elems[i];
+    for (size_t i = 0; i < state->axes.count; i++) free(state->axes.elems[i].elems);
+    noh_da_free(&state->axes);
+
+    for (size_t i = 0; i < state->touches.count; i++) free(state->touches.elems[i].tracking_ids);
+    noh_da_free(&state->touches);
+
+    free(state->routes);
+    state->routes = NULL;
+
+    noh_da_free(&state->decay_deadlines);
+}
+
+///////////////////////// Snapshots /////////////////////////
+
+// Turns a pointer into a snapshot buffer into an offset from the start of the buffer.
+#define hooks_snapshot_offset(buffer, ptr) ((void*)((char*)(ptr) - (buffer)))
+
+// Turns an offset stored by hooks_snapshot_offset back into a pointer into the (copied) snapshot buffer.
+#define hooks_snapshot_pointer(buffer, offset) ((void*)((buffer) + (size_t)(offset)))
+
+// Writes a snapshot of an NBI_Input_State into a buffer, as an NB_Input_State followed by all its lists. All pointers
+// in the snapshot are stored as offsets from the start of the buffer, so the snapshot can be copied elsewhere as one
+// block, after which hooks_relocate_snapshot makes the pointers valid again.
+// Returns the size of the snapshot, or 0 if it does not fit in the capacity of the buffer.
+size_t hooks_write_snapshot(NBI_Input_State *state, size_t event_overflows, uint64 generation, char *buffer, size_t capacity) {
+    // Determine the space needed. The structs go first and the int data before the uint16 data, so everything stays
+    // aligned.
+    size_t needed_space = sizeof(NB_Input_State);
+    needed_space += state->pressed_keys.count * sizeof(NB_Pressed_Keys_List);
+    needed_space += state->axes.count * sizeof(NB_Axis_History);
+    needed_space += state->touches.count * sizeof(NB_Touch_Contacts);
 
-        // Reserve space for the struct and all elements in the list.
-        no_keys_lists++;
-        needed_space += sizeof(NB_Pressed_Keys_List);
-        needed_space += list->count * sizeof(list->elems[0]);
+    // Space for key statistics, which are structs as well.
+    size_t stats_count = 0;
+    for (size_t i = 0; i < state->pressed_keys.count; i++) {
+        stats_count += state->pressed_keys.elems[i].stats.count;
     }
+    needed_space += stats_count * sizeof(NB_Key_Stats);
 
     // Space for axis histories.
     for (size_t i = 0; i < state->axes.count; i++) {
-        NBI_Axis_History *history = &state->axes.elems[i];
-
-        // Reserve space for the struct and all elements in the list.
-        no_axes++;
-        needed_space += sizeof(NB_Axis_History);
-        needed_space += history->count * sizeof(history->elems[0]);
+        needed_space += state->axes.elems[i].count * sizeof(int);
     }
 
-    noh_arena_reserve(arena, needed_space);
-
-    // Prepare result structure.
-    NB_Pressed_Keys_Lists keys_lists = {
-        .count = no_keys_lists,
-        .elems = (NB_Pressed_Keys_List *) noh_arena_alloc(arena, no_keys_lists * sizeof(NB_Pressed_Keys_List))
-    };
-    NB_Axis_Histories axis_histories = {
-        .count = no_axes,
-        .elems = (NB_Axis_History *) noh_arena_alloc(arena, no_axes * sizeof(NB_Axis_History))
-    };
-    NB_Input_State result = { .pressed_keys = keys_lists, .axes = axis_histories };
+    // Space for touch contacts.
+    for (size_t i = 0; i < state->touches.count; i++) {
+        needed_space += state->touches.elems[i].count * 3 * sizeof(int);
+    }
 
-    // Copy the keys lists.
-    size_t j = 0;
+    // Space for pressed keys.
     for (size_t i = 0; i < state->pressed_keys.count; i++) {
-        NBI_Pressed_Keys_List *list = &state->pressed_keys.elems[i];
+        needed_space += state->pressed_keys.elems[i].pressed_count * sizeof(uint16);
+    }
 
-        size_t data_size = list->count * sizeof(list->elems[0]);
-        NB_Pressed_Keys_List new_list = {
-            .count = list->count,
-            .elems = noh_arena_alloc(arena, data_size),
+    if (needed_space > capacity) return 0;
 
-            .device_index = list->device_index
-        };
-        memcpy(new_list.elems, list->elems, data_size);
-        result.pressed_keys.elems[j++] = new_list;
-    }
+    // Prepare result structure.
+    NB_Input_State *result = (NB_Input_State *)buffer;
+    NB_Pressed_Keys_List *keys_lists = (NB_Pressed_Keys_List *)(result + 1);
+    NB_Axis_History *axis_histories = (NB_Axis_History *)(keys_lists + state->pressed_keys.count);
+    NB_Touch_Contacts *touches = (NB_Touch_Contacts *)(axis_histories + state->axes.count);
+    NB_Key_Stats *key_stats = (NB_Key_Stats *)(touches + state->touches.count);
+    char *data = (char *)(key_stats + stats_count);
+
+    result->pressed_keys.count = state->pressed_keys.count;
+    result->pressed_keys.elems = hooks_snapshot_offset(buffer, keys_lists);
+    result->axes.count = state->axes.count;
+    result->axes.elems = hooks_snapshot_offset(buffer, axis_histories);
+    result->touches.count = state->touches.count;
+    result->touches.elems = hooks_snapshot_offset(buffer, touches);
+    result->event_overflows = event_overflows;
+    result->generation = generation;
 
     // Copy the axes.
-    j = 0;
     for (size_t i = 0; i < state->axes.count; i++) {
         NBI_Axis_History *history = &state->axes.elems[i];
 
@@ -113,7 +290,7 @@ NB_Input_State copy_nbi_state_to_nb_state(Noh_Arena *arena, NBI_Input_State *sta
         size_t data_size = history->count * elem_size;
         NB_Axis_History new_history = {
             .count = history->count,
-            .elems = noh_arena_alloc(arena, data_size),
+            .elems = hooks_snapshot_offset(buffer, data),
 
             .current_value = history->current_value,
 
@@ -128,13 +305,13 @@ NB_Input_State copy_nbi_state_to_nb_state(Noh_Arena *arena, NBI_Input_State *sta
 
         if (history->count < history->capacity) {
             // Just copy the whole data from 0 to the count.
-            memcpy(new_history.elems, history->elems, data_size);
+            memcpy(data, history->elems, data_size);
         } else {
             size_t slice_1_count = history->count - history->start;
             // First slice to the start of the buffer, from the start pointer.
             if (slice_1_count > 0) {
                 memcpy(
-                    new_history.elems,
+                    data,
                     history->elems + history->start,
                     slice_1_count * elem_size);
             }
@@ -143,18 +320,209 @@ NB_Input_State copy_nbi_state_to_nb_state(Noh_Arena *arena, NBI_Input_State *sta
             // Second slice after the first slice, from the beginning of the original buffer to the start pointer.
             if (slice_2_count > 0) {
                 memcpy(
-                    new_history.elems + slice_1_count,
+                    data + slice_1_count * elem_size,
                     history->elems,
                     slice_2_count * elem_size);
             }
         }
 
-        result.axes.elems[j++] = new_history;
+        data += data_size;
+        axis_histories[i] = new_history;
+    }
+
+    // Copy the touch contacts, the slots are stored in one block like in the state.
+    for (size_t i = 0; i < state->touches.count; i++) {
+        NBI_Touch_Contacts *contacts = &state->touches.elems[i];
+
+        size_t data_size = contacts->count * 3 * sizeof(int);
+        NB_Touch_Contacts new_contacts = {
+            .tracking_ids = hooks_snapshot_offset(buffer, data),
+            .x = hooks_snapshot_offset(buffer, data + contacts->count * sizeof(int)),
+            .y = hooks_snapshot_offset(buffer, data + contacts->count * 2 * sizeof(int)),
+            .count = contacts->count,
+
+            .min_x = contacts->min_x,
+            .max_x = contacts->max_x,
+            .min_y = contacts->min_y,
+            .max_y = contacts->max_y,
+
+            .device_index = contacts->device_index
+        };
+        memcpy(data, contacts->tracking_ids, data_size);
+
+        data += data_size;
+        touches[i] = new_contacts;
+    }
+
+    // Copy the keys lists.
+    for (size_t i = 0; i < state->pressed_keys.count; i++) {
+        NBI_Pressed_Keys_List *list = &state->pressed_keys.elems[i];
+
+        size_t data_size = list->pressed_count * sizeof(list->elems[0]);
+        NB_Pressed_Keys_List new_list = {
+            .count = list->pressed_count,
+            .elems = hooks_snapshot_offset(buffer, data),
+
+            .device_index = list->device_index,
+
+            .stats = hooks_snapshot_offset(buffer, key_stats),
+            .stats_count = list->stats.count,
+            .presses = list->stats.presses,
+            .keys_per_second = list->stats.window_presses
+        };
+
+        // The statistics are kept in the same layout they are published in.
+        if (list->stats.count > 0) memcpy(key_stats, list->stats.elems, list->stats.count * sizeof(NB_Key_Stats));
+        key_stats += list->stats.count;
+
+        // Copy only the keys that were not released.
+        uint16 *keys = (uint16 *)data;
+        for (size_t j = 0; j < list->count; j++) {
+            if (list->elems[j] != 0) *keys++ = list->elems[j];
+        }
+
+        data += data_size;
+        keys_lists[i] = new_list;
+    }
+
+    return needed_space;
+}
+
+// Turns the offsets in a copied snapshot back into pointers, and returns the input state at the start of it.
+NB_Input_State hooks_relocate_snapshot(char *snapshot) {
+    NB_Input_State result = *(NB_Input_State *)snapshot;
+
+    result.pressed_keys.elems = hooks_snapshot_pointer(snapshot, result.pressed_keys.elems);
+    for (size_t i = 0; i < result.pressed_keys.count; i++) {
+        NB_Pressed_Keys_List *list = &result.pressed_keys.elems[i];
+        list->elems = hooks_snapshot_pointer(snapshot, list->elems);
+        list->stats = hooks_snapshot_pointer(snapshot, list->stats);
+    }
+
+    result.axes.elems = hooks_snapshot_pointer(snapshot, result.axes.elems);
+    for (size_t i = 0; i < result.axes.count; i++) {
+        NB_Axis_History *history = &result.axes.elems[i];
+        history->elems = hooks_snapshot_pointer(snapshot, history->elems);
+    }
+
+    result.touches.elems = hooks_snapshot_pointer(snapshot, result.touches.elems);
+    for (size_t i = 0; i < result.touches.count; i++) {
+        NB_Touch_Contacts *contacts = &result.touches.elems[i];
+        contacts->tracking_ids = hooks_snapshot_pointer(snapshot, contacts->tracking_ids);
+        contacts->x = hooks_snapshot_pointer(snapshot, contacts->x);
+        contacts->y = hooks_snapshot_pointer(snapshot, contacts->y);
     }
 
     return result;
 }
 
+// The number of buffers snapshots are published into. With three buffers, the writer can always write to a buffer
+// that is not the latest one, and a reader only has to retry if the writer published twice during its copy.
+#define NBI_SNAPSHOT_BUFFERS 3
+
+// A single buffer a snapshot is published into.
+typedef struct {
+    _Atomic size_t sequence; // Odd while the buffer is being written, increased again when done.
+    _Atomic size_t size; // The size of the snapshot currently in the buffer.
+    char *data;
+} NBI_Snapshot_Buffer;
+
+// Published snapshots of the input state, with a single writer and any number of readers. Readers never take a lock,
+// and the writer never waits for a reader.
+typedef struct {
+    NBI_Snapshot_Buffer buffers[NBI_SNAPSHOT_BUFFERS];
+    size_t capacity; // The capacity of each of the buffers.
+    _Atomic size_t latest; // The index of the buffer containing the latest complete snapshot.
+    _Atomic uint64 generation; // The generation of the latest snapshot, only written by the writer.
+    _Atomic size_t read_retries; // The number of times a reader had to start over, where others would wait for a lock.
+
+    // The monotonic time in nanoseconds of the earliest event in any snapshot published since a reader last took it,
+    // 0 if none. The writer only lowers it, a reader takes it and sets it back to 0.
+    _Atomic int64 unread_input_time;
+} NBI_Snapshots;
+
+// Publishes a snapshot of the input state. Returns false if it did not fit in the buffers.
+// Must only be called from the thread that owns the input state.
+bool hooks_publish_snapshot(NBI_Snapshots *snapshots, NBI_Input_State *state, size_t event_overflows) {
+    size_t index = (atomic_load_explicit(&snapshots->latest, memory_order_relaxed) + 1) % NBI_SNAPSHOT_BUFFERS;
+    NBI_Snapshot_Buffer *buffer = &snapshots->buffers[index];
+
+    // Mark the buffer as being written, before any of the data is touched.
+    size_t sequence = atomic_load_explicit(&buffer->sequence, memory_order_relaxed);
+    atomic_store_explicit(&buffer->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    uint64 generation = atomic_load_explicit(&snapshots->generation, memory_order_relaxed) + 1;
+    size_t size = hooks_write_snapshot(state, event_overflows, generation, buffer->data, snapshots->capacity);
+    if (size == 0) {
+        // Leave the buffer as it was, it is not the latest so no reader should be interested in it anyway.
+        atomic_store_explicit(&buffer->sequence, sequence + 2, memory_order_release);
+        return false;
+    }
+
+    atomic_store_explicit(&buffer->size, size, memory_order_relaxed);
+    atomic_store_explicit(&buffer->sequence, sequence + 2, memory_order_release);
+    atomic_store_explicit(&snapshots->latest, index, memory_order_release);
+
+    // The events applied so far are now visible.
+    atomic_store_explicit(&snapshots->generation, generation, memory_order_release);
+
+    // Only after publishing, so a reader that takes the time has the snapshot with these events or a later one. A
+    // reader that takes the time just before this reads these events a frame before it is counted for them.
+    int64 input_time = state->pending_input_time;
+    int64 unread = atomic_load_explicit(&snapshots->unread_input_time, memory_order_relaxed);
+    while (input_time != 0 && (unread == 0 || input_time < unread) &&
+           !atomic_compare_exchange_weak_explicit(&snapshots->unread_input_time, &unread, input_time,
+                                                  memory_order_relaxed, memory_order_relaxed));
+    state->pending_input_time = 0;
+    return true;
+}
+
+// Returns the generation of the latest published snapshot, which changes whenever the input state does. Can be
+// called from any thread, and is a lot cheaper than reading the snapshot to find out whether it changed.
+uint64 hooks_snapshot_generation(NBI_Snapshots *snapshots) {
+    return atomic_load_explicit(&snapshots->generation, memory_order_acquire);
+}
+
+// Copies the latest published snapshot into the arena and returns it. Can be called from any thread. The input time
+// of the result is that of the earliest event published since the previous read, so if there are several readers,
+// only one of them should use it.
+NB_Input_State hooks_read_snapshot(NBI_Snapshots *snapshots, Noh_Arena *arena) {
+    char *copy = NULL;
+    size_t copy_capacity = 0;
+
+    // Taken before copying, so the snapshot that is copied contains all the events it is for.
+    int64 input_time = atomic_exchange_explicit(&snapshots->unread_input_time, 0, memory_order_acquire);
+
+    while (true) {
+        size_t index = atomic_load_explicit(&snapshots->latest, memory_order_acquire);
+        NBI_Snapshot_Buffer *buffer = &snapshots->buffers[index];
+
+        size_t sequence = atomic_load_explicit(&buffer->sequence, memory_order_acquire);
+        if (sequence % 2 == 1) {
+            // Being written, the latest index will move on shortly.
+            atomic_fetch_add_explicit(&snapshots->read_retries, 1, memory_order_relaxed);
+            continue;
+        }
+
+        size_t size = atomic_load_explicit(&buffer->size, memory_order_relaxed);
+        if (size > copy_capacity) {
+            copy = noh_arena_alloc(arena, size);
+            copy_capacity = size;
+        }
+        memcpy(copy, buffer->data, size);
+
+        // Only use the copy if the buffer was not written to while copying.
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&buffer->sequence, memory_order_relaxed) == sequence) break;
+        atomic_fetch_add_explicit(&snapshots->read_retries, 1, memory_order_relaxed);
+    }
+
+    NB_Input_State result = hooks_relocate_snapshot(copy);
+    result.input_time = input_time;
+    return result;
+}
+
 // Define a new pressed keys list, and return a pointer to this list.
 NBI_Pressed_Keys_List *hooks_define_key_list(NBI_Input_State *state, NB_Input_Device *dev) {
     noh_assert(state);
@@ -164,6 +532,7 @@ NBI_Pressed_Keys_List *hooks_define_key_list(NBI_Input_State *state, NB_Input_De
         .elems = NULL,
         .count = 0,
         .capacity = 0,
+        .pressed_count = 0,
         .device_index = dev->index
     };
 
@@ -217,45 +586,329 @@ NBI_Axis_History *hooks_define_rel_axis(NBI_Input_State *state, NB_Input_Device
     return &state->axes.elems[state->axes.count - 1];
 }
 
-// Register a keypress or release for the secified device and key.
-// This function assumes a pointer to the relevant pressed keys list is already available.
-void hooks_add_key_(NBI_Pressed_Keys_List *list, uint16 key, bool down) {
+// Define the contacts of a multi-touch device with the specified number of slots, and return a pointer to them.
+// All slots start without a contact.
+NBI_Touch_Contacts *hooks_define_touch_contacts(NBI_Input_State *state, NB_Input_Device *dev, size_t slot_count, int min_x, int max_x, int min_y, int max_y) {
+    noh_assert(state);
+    noh_assert(dev);
+    noh_assert(slot_count > 0 && slot_count <= NBI_MAX_TOUCH_SLOTS);
+
+    int *slots = noh_realloc_check(NULL, slot_count * 3 * sizeof(int));
+    NBI_Touch_Contacts contacts = {
+        .tracking_ids = slots,
+        .x = slots + slot_count,
+        .y = slots + slot_count * 2,
+        .count = slot_count,
+        .current_slot = 0,
+
+        .min_x = min_x,
+        .max_x = max_x,
+        .min_y = min_y,
+        .max_y = max_y,
+
+        .device_index = dev->index
+    };
+    for (size_t i = 0; i < slot_count; i++) {
+        contacts.tracking_ids[i] = -1;
+        contacts.x[i] = 0;
+        contacts.y[i] = 0;
+    }
+
+    noh_da_append(&state->touches, contacts);
+    return &state->touches.elems[state->touches.count - 1];
+}
+
+// Adds a deadline to the decay heap.
+static void hooks_push_deadline(NBI_Axis_Deadlines *heap, int64 deadline, size_t axis) {
+    NBI_Axis_Deadline elem = { .deadline = deadline, .axis = axis };
+    noh_da_append(heap, elem);
+
+    // Sift up.
+    size_t i = heap->count - 1;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (heap->elems[parent].deadline <= elem.deadline) break;
+
+        heap->elems[i] = heap->elems[parent];
+        i = parent;
+    }
+    heap->elems[i] = elem;
+}
+
+// Removes and returns the earliest deadline from the decay heap, which must not be empty.
+static NBI_Axis_Deadline hooks_pop_deadline(NBI_Axis_Deadlines *heap) {
+    noh_assert(heap->count > 0);
+
+    NBI_Axis_Deadline result = heap->elems[0];
+    NBI_Axis_Deadline last = heap->elems[--heap->count];
+
+    // Sift the last element down from the top.
+    size_t i = 0;
+    while (true) {
+        size_t child = 2 * i + 1;
+        if (child >= heap->count) break;
+        if (child + 1 < heap->count && heap->elems[child + 1].deadline < heap->elems[child].deadline) child++;
+        if (last.deadline <= heap->elems[child].deadline) break;
+
+        heap->elems[i] = heap->elems[child];
+        i = child;
+    }
+    if (heap->count > 0) heap->elems[i] = last;
+
+    return result;
+}
+
+// Builds the routes from every device, event type and code to the list in the state that should receive the event,
+// and the deadlines of all decaying axes, since these also refer to the axes by index.
+// Must be called again whenever lists are added or removed, since this moves the other lists.
+void hooks_build_routes(NBI_Input_State *state) {
+    noh_assert(state);
+
+    if (state->routes == NULL) state->routes = malloc(NBI_MAX_DEVICES * sizeof(NBI_Device_Routes));
+    noh_assert(state->routes != NULL && "Could not allocate enough memory");
+    memset(state->routes, 0, NBI_MAX_DEVICES * sizeof(NBI_Device_Routes));
+
+    for (size_t i = 0; i < state->pressed_keys.count; i++) {
+        NBI_Pressed_Keys_List *list = &state->pressed_keys.elems[i];
+        if (list->device_index >= NBI_MAX_DEVICES) continue;
+
+        state->routes[list->device_index].key_list = i + 1;
+    }
+
+    for (size_t i = 0; i < state->touches.count; i++) {
+        NBI_Touch_Contacts *contacts = &state->touches.elems[i];
+        if (contacts->device_index >= NBI_MAX_DEVICES) continue;
+
+        state->routes[contacts->device_index].touches = i + 1;
+    }
+
+    for (size_t i = 0; i < state->axes.count; i++) {
+        NBI_Axis_History *history = &state->axes.elems[i];
+        if (history->device_index >= NBI_MAX_DEVICES) continue;
+
+        NBI_Device_Routes *routes = &state->routes[history->device_index];
+        if (history->is_absolute && history->axis_id < NBI_ABS_CODES) routes->abs_axes[history->axis_id] = i + 1;
+        if (!history->is_absolute && history->axis_id < NBI_REL_CODES) routes->rel_axes[history->axis_id] = i + 1;
+
+        size_t gesture = history->axis_id - NB_Gesture_Swipe_2_X;
+        if (!history->is_absolute && history->axis_id >= NB_Gesture_Swipe_2_X && gesture < NB_GESTURE_AXES) {
+            routes->gesture_axes[gesture] = i + 1;
+        }
+    }
+
+    noh_da_reset(&state->decay_deadlines);
+    for (size_t i = 0; i < state->axes.count; i++) {
+        int64 decay_at = state->axes.elems[i].decay_at;
+        if (decay_at != 0) hooks_push_deadline(&state->decay_deadlines, decay_at, i);
+    }
+}
+
+// Looks up the pressed keys list of a device, or NULL if it has none.
+static inline NBI_Pressed_Keys_List *hooks_route_key_list(NBI_Input_State *state, size_t device_index) {
+    if (state->routes == NULL || device_index >= NBI_MAX_DEVICES) return NULL;
+
+    uint32 route = state->routes[device_index].key_list;
+    return route == 0 ? NULL : &state->pressed_keys.elems[route - 1];
+}
+
+// Looks up the touch contacts of a device, or NULL if it is not a multi-touch device.
+static inline NBI_Touch_Contacts *hooks_route_touches(NBI_Input_State *state, size_t device_index) {
+    if (state->routes == NULL || device_index >= NBI_MAX_DEVICES) return NULL;
+
+    uint32 route = state->routes[device_index].touches;
+    return route == 0 ? NULL : &state->touches.elems[route - 1];
+}
+
+// Looks up the history of an axis of a device, or NULL if the device does not have this axis.
+static inline NBI_Axis_History *hooks_route_axis(NBI_Input_State *state, size_t device_index, uint16 axis_id, bool is_absolute) {
+    if (state->routes == NULL || device_index >= NBI_MAX_DEVICES) return NULL;
+
+    NBI_Device_Routes *routes = &state->routes[device_index];
+    uint32 route = 0;
+    if (is_absolute && axis_id < NBI_ABS_CODES) route = routes->abs_axes[axis_id];
+    if (!is_absolute && axis_id < NBI_REL_CODES) route = routes->rel_axes[axis_id];
+
+    size_t gesture = axis_id - NB_Gesture_Swipe_2_X;
+    if (!is_absolute && axis_id >= NB_Gesture_Swipe_2_X && gesture < NB_GESTURE_AXES) route = routes->gesture_axes[gesture];
+    return route == 0 ? NULL : &state->axes.elems[route - 1];
+}
+
+///////////////////////// Key statistics /////////////////////////
+
+// Moves the sliding window of key presses forward to the bucket of the specified monotonic time in nanoseconds,
+// dropping the buckets that fell out of it. Returns true if the number of presses in the window changed.
+bool hooks_advance_key_window(NBI_Key_Stats *stats, int64 time) {
+    int64 bucket = time / ((int64)NBI_KPS_BUCKET_MS * 1000 * 1000);
+    if (bucket <= stats->newest_bucket) return false; // Still in the newest bucket.
+
+    // Every bucket is cleared at most once, even after a long pause.
+    int64 steps = bucket - stats->newest_bucket;
+    if (steps > NBI_KPS_BUCKETS) steps = NBI_KPS_BUCKETS;
+
+    uint32 window_presses = stats->window_presses;
+    for (int64 i = 1; i <= steps; i++) {
+        size_t index = (stats->newest_bucket + i) % NBI_KPS_BUCKETS;
+        stats->window_presses -= stats->buckets[index];
+        stats->buckets[index] = 0;
+    }
+
+    stats->newest_bucket = bucket;
+    return stats->window_presses != window_presses;
+}
+
+// Counts a press or release of a key at the specified monotonic time in nanoseconds.
+void hooks_count_key(NBI_Key_Stats *stats, uint16 key, bool down, int64 time) {
+    if (stats->slots[key] == 0) {
+        if (!down) return; // Released without being seen pressed, like a key that was held when probing.
+
+        NB_Key_Stats key_stats = { .key = key };
+        noh_da_append(stats, key_stats);
+        stats->slots[key] = stats->count;
+    }
+
+    NB_Key_Stats *key_stats = &stats->elems[stats->slots[key] - 1];
+    if (down) {
+        key_stats->presses++;
+        key_stats->pressed_at = time;
+        stats->presses++;
+
+        // Events of a device arrive in order, so a press is never older than the newest bucket.
+        hooks_advance_key_window(stats, time);
+        stats->buckets[stats->newest_bucket % NBI_KPS_BUCKETS]++;
+        stats->window_presses++;
+    } else if (key_stats->pressed_at != 0) {
+        key_stats->releases++;
+        key_stats->hold_time += time - key_stats->pressed_at;
+        key_stats->pressed_at = 0;
+    }
+}
+
+// Moves the key press windows of all devices forward to the specified monotonic time in nanoseconds. Returns true if
+// the number of key presses per second of any device changed.
+bool hooks_advance_key_windows(NBI_Input_State *state, int64 time) {
+    bool changed = false;
+    for (size_t i = 0; i < state->pressed_keys.count; i++) {
+        NBI_Key_Stats *stats = &state->pressed_keys.elems[i].stats;
+        if (stats->window_presses > 0 && hooks_advance_key_window(stats, time)) changed = true;
+    }
+    return changed;
+}
+
+// Returns the monotonic time in nanoseconds at which the oldest key press in any window drops out of it, or 0 if all
+// windows are empty.
+int64 hooks_next_key_window_change(NBI_Input_State *state) {
+    int64 result = 0;
+    for (size_t i = 0; i < state->pressed_keys.count; i++) {
+        NBI_Key_Stats *stats = &state->pressed_keys.elems[i].stats;
+        if (stats->window_presses == 0) continue;
+
+        // The oldest bucket with presses leaves the window when the newest bucket is a full window after it.
+        int64 bucket = stats->newest_bucket - NBI_KPS_BUCKETS + 1;
+        while (stats->buckets[bucket % NBI_KPS_BUCKETS] == 0) bucket++;
+
+        int64 change_at = (bucket + NBI_KPS_BUCKETS) * NBI_KPS_BUCKET_MS * 1000 * 1000;
+        if (result == 0 || change_at < result) result = change_at;
+    }
+    return result;
+}
+
+// Moves the statistics of a pressed keys list to another list of the same device, when it is replaced.
+void hooks_move_key_stats(NBI_Pressed_Keys_List *list, NBI_Pressed_Keys_List *from) {
+    noh_da_free(&list->stats);
+    list->stats = from->stats;
+    from->stats = (NBI_Key_Stats){0};
+
+    // The device was reconnected, it is unknown how long the held keys were held.
+    for (size_t i = 0; i < list->stats.count; i++) list->stats.elems[i].pressed_at = 0;
+}
+
+///////////////////////// Keys /////////////////////////
+
+// Releases all keys in a pressed keys list.
+void hooks_clear_keys_(NBI_Pressed_Keys_List *list) {
     noh_assert(list);
 
-    // Check if the key exists.
-    int index = -1;
+    // Whether and when the keys were released is unknown, so their hold times are not counted.
     for (size_t i = 0; i < list->count; i++) {
-        if (list->elems[i] == key) {
-            index = i;
-            break;
-        }
+        uint16 key = list->elems[i];
+        if (key != 0 && list->stats.slots[key] != 0) list->stats.elems[list->stats.slots[key] - 1].pressed_at = 0;
     }
 
-    if (down && index < 0) {
+    memset(list->pressed, 0, sizeof(list->pressed));
+    list->pressed_count = 0;
+    noh_da_reset(list);
+}
+
+// Register a keypress or release for the secified device and key, at the monotonic time in nanoseconds of the event.
+// Changes with a time of 0 are not from an event, like keys found pressed when probing, and are not counted in the
+// statistics.
+// This function assumes a pointer to the relevant pressed keys list is already available.
+void hooks_add_key_(NBI_Pressed_Keys_List *list, uint16 key, bool down, int64 time) {
+    noh_assert(list);
+    if (key == 0 || key >= NBI_KEY_CODES) return; // Not a valid key code.
+
+    uint64 bit = (uint64)1 << (key % 64);
+    bool is_down = (list->pressed[key / 64] & bit) != 0;
+    if (time != 0 && down != is_down) hooks_count_key(&list->stats, key, down, time);
+
+    if (down && !is_down) {
         // Add the key.
+        list->pressed[key / 64] |= bit;
+        list->positions[key] = list->count;
+        list->pressed_count++;
         noh_da_append(list, key);
-    } else if (!down && index >= 0) {
-        // Remove the key.
-        noh_da_remove_at(list, (size_t)index);
+    } else if (!down && is_down) {
+        // Remove the key, leaving a 0 at its position.
+        list->pressed[key / 64] &= ~bit;
+        list->elems[list->positions[key]] = 0;
+        list->pressed_count--;
+
+        if (list->pressed_count == 0) {
+            // Nothing pressed anymore, the list can start over.
+            noh_da_reset(list);
+        } else if (list->count > 2 * list->pressed_count + 16) {
+            // Too many released keys in the list, compact it. This moves every key at most once per this many
+            // releases, so it is constant time on average.
+            size_t write = 0;
+            for (size_t i = 0; i < list->count; i++) {
+                uint16 pressed_key = list->elems[i];
+                if (pressed_key == 0) continue;
+
+                list->positions[pressed_key] = write;
+                list->elems[write++] = pressed_key;
+            }
+            list->count = write;
+        }
     }
     // Otherwise, the key can remain in or out of the list.
 }
 
 // Register a keypress or release for the secified device and key.
-// This function looks up the pressed keys list by device index.
-void hooks_add_key(NBI_Input_State *state, size_t device_index, uint16 key, bool down) {
+// This function looks up the pressed keys list through the routes of the device.
+void hooks_add_key(NBI_Input_State *state, size_t device_index, uint16 key, bool down, int64 time) {
     noh_assert(state);
 
-    for (size_t i = 0; i < state->pressed_keys.count; i++) {
-        NBI_Pressed_Keys_List *list = &state->pressed_keys.elems[i];
-        if (list->device_index == device_index) {
-            hooks_add_key_(list, key, down);
-            return;
-        }
+    NBI_Pressed_Keys_List *list = hooks_route_key_list(state, device_index);
+    if (list == NULL) {
+        noh_log(NOH_WARNING, "Could not find key list of device %zu for entering keypress.", device_index);
+        return;
     }
 
-    // The list was not found, log a warning.
-    noh_log(NOH_WARNING, "Could not find key list of device %zu for entering keypress.", device_index);
+    hooks_add_key_(list, key, down, time);
+}
+
+// Returns the time in nanoseconds at which an axis history updated at the specified time should decay.
+static inline int64 hooks_decay_time(const struct timespec *time) {
+    return (int64)time->tv_sec * 1000 * 1000 * 1000 + time->tv_nsec + (int64)NBI_SMOOTH_INTERVAL * 1000 * 1000;
+}
+
+// Makes an axis history decay one smooth interval after the specified time, unless it is updated again before that.
+static void hooks_schedule_decay(NBI_Input_State *state, NBI_Axis_History *history, const struct timespec *time) {
+    int64 decay_at = hooks_decay_time(time);
+
+    // Only axes at rest need a new deadline, a decaying axis moves its deadline when the current one is reached.
+    if (history->decay_at == 0) hooks_push_deadline(&state->decay_deadlines, decay_at, history - state->axes.elems);
+    history->decay_at = decay_at;
 }
 
 // Add a new absolute value to an axis history.
@@ -265,10 +918,17 @@ void hooks_add_abs_value_(NBI_Axis_History *history, const struct timespec *time
     noh_assert(history);
     noh_assert(time);
 
-    long ms_diff = noh_diff_timespec_ms(&history->last_updated_at, time);
-    if (ms_diff < 1) ms_diff = 1; // FUTURE: Do we need to be more precise with the time differences?
+    // The speed in units per millisecond, computed from the nanosecond timestamps of the events. Events less than a
+    // millisecond apart count their full difference, rather than being scaled up.
+    int64 ns_diff = noh_diff_timespec_ns(time, &history->last_updated_at);
+    if (ns_diff < 1000 * 1000) ns_diff = 1000 * 1000;
 
-    int diff = (value - history->current_value) / ms_diff;
+    // Rounded away from zero, so slow movement, or the first movement after a pause, is never lost as a 0.
+    int64 value_diff = (int64)value - history->current_value;
+    int64 magnitude = value_diff < 0 ? -value_diff : value_diff;
+    int64 speed = (magnitude * 1000 * 1000 + ns_diff - 1) / ns_diff;
+    if (value_diff < 0) speed = -speed;
+    int diff = speed > INT_MAX ? INT_MAX : speed < INT_MIN ? INT_MIN : (int)speed;
 
     history->last_updated_at = *time;
     history->current_value = value;
@@ -278,20 +938,18 @@ void hooks_add_abs_value_(NBI_Axis_History *history, const struct timespec *time
 
 // Add a new absolute value to an axis history.
 // Updates the value and pushes into the circular history buffer.
-// This function looks up the axis history by device index and axis id.
+// This function looks up the axis history through the routes of the device.
 void hooks_add_abs_value(NBI_Input_State *state, size_t device_index, uint16 axis_id, const struct timespec *time, int value) {
     noh_assert(state);
 
-    for (size_t i = 0; i < state->axes.count; i++) {
-        NBI_Axis_History *history = &state->axes.elems[i];
-        if (axis_id == history->axis_id && history->device_index == device_index && history->is_absolute) {
-            hooks_add_abs_value_(history, time, value);
-            return;
-        }
+    NBI_Axis_History *history = hooks_route_axis(state, device_index, axis_id, true);
+    if (history == NULL) {
+        noh_log(NOH_WARNING, "Could not find axis %hu of device %zu for entering abs value.", axis_id, device_index);
+        return;
     }
 
-    // The axis was not found, log a warning.
-    noh_log(NOH_WARNING, "Could not find axis %hu of device %zu for entering abs value.", axis_id, device_index);
+    hooks_add_abs_value_(history, time, value);
+    hooks_schedule_decay(state, history, time);
 }
 
 // Add a new relative value to an axis history. Does not update the absolute value.
@@ -307,18 +965,443 @@ void hooks_add_rel_value_(NBI_Axis_History *history, const struct timespec *time
 
 // Add a new relative value to an axis history. Does not update the absolute value.
 // Can still be used for an absolute value when pushing 0s to revert the relative history to 0.
-// This function looks up the axis history by device index and axis id.
+// This function looks up the axis history through the routes of the device.
 void hooks_add_rel_value(NBI_Input_State *state, size_t device_index, uint16 axis_id, const struct timespec *time, int value) {
     noh_assert(state);
 
-    for (size_t i = 0; i < state->axes.count; i++) {
-        NBI_Axis_History *history = &state->axes.elems[i];
-        if (axis_id == history->axis_id && history->device_index == device_index && !history->is_absolute) {
-            hooks_add_rel_value_(history, time, value);
-            return;
+    NBI_Axis_History *history = hooks_route_axis(state, device_index, axis_id, false);
+    if (history == NULL) {
+        noh_log(NOH_WARNING, "Could not find axis %hu of device %zu for entering rel value.", axis_id, device_index);
+        return;
+    }
+
+    hooks_add_rel_value_(history, time, value);
+    hooks_schedule_decay(state, history, time);
+}
+
+// Pushes a 0 into every axis history whose decay deadline has passed, so they tend back to 0. Histories that are not
+// all 0 yet get a new deadline one smooth interval later. Returns true if any history was updated.
+bool hooks_decay_axes(NBI_Input_State *state, const struct timespec *time) {
+    noh_assert(state);
+    noh_assert(time);
+
+    int64 now = (int64)time->tv_sec * 1000 * 1000 * 1000 + time->tv_nsec;
+    bool result = false;
+
+    NBI_Axis_Deadlines *heap = &state->decay_deadlines;
+    while (heap->count > 0 && heap->elems[0].deadline <= now) {
+        NBI_Axis_Deadline deadline = hooks_pop_deadline(heap);
+        NBI_Axis_History *history = &state->axes.elems[deadline.axis];
+        if (history->decay_at == 0) continue;
+
+        if (history->decay_at > deadline.deadline) {
+            // Updated since this deadline was set, wait for the new one.
+            hooks_push_deadline(heap, history->decay_at, deadline.axis);
+            continue;
+        }
+
+        // Fill in relative even for absolute, so no absolute value is overwritten.
+        hooks_add_rel_value_(history, time, 0);
+        result = true;
+
+        bool at_rest = true;
+        for (size_t i = 0; i < history->count; i++) {
+            if (history->elems[i] != 0) at_rest = false;
+        }
+
+        history->decay_at = at_rest ? 0 : hooks_decay_time(time);
+        if (!at_rest) hooks_push_deadline(heap, history->decay_at, deadline.axis);
+    }
+
+    return result;
+}
+
+// Returns the monotonic time in nanoseconds at which the next axis history should decay, or 0 if all are at rest.
+int64 hooks_next_decay(NBI_Input_State *state) {
+    noh_assert(state);
+    return state->decay_deadlines.count > 0 ? state->decay_deadlines.elems[0].deadline : 0;
+}
+
+// Returns whether any device has pressed keys.
+bool hooks_any_keys_pressed(NBI_Input_State *state) {
+    noh_assert(state);
+
+    for (size_t i = 0; i < state->pressed_keys.count; i++) {
+        if (state->pressed_keys.elems[i].pressed_count > 0) return true;
+    }
+    return false;
+}
+
+///////////////////////// Gestures /////////////////////////
+
+// The longest time in milliseconds that fingers can be on a touch device for lifting them to count as a tap.
+#define NBI_TAP_TIME 250
+
+// How far the fingers must move, as a fraction of the size of the touch device, before a gesture is recognized.
+// Until then, the fingers are assumed to be resting or tapping.
+#define NBI_GESTURE_SLOP (1. / 50)
+
+// Adds or removes the contact in a slot to or from the sums of the gesture recognizer.
+static void hooks_sum_contact(NBI_Touch_Contacts *contacts, size_t slot, int sign) {
+    NBI_Gesture *gesture = &contacts->gesture;
+    int64 x = contacts->x[slot];
+    int64 y = contacts->y[slot];
+
+    gesture->active += sign;
+    gesture->sum_x += sign * x;
+    gesture->sum_y += sign * y;
+    gesture->sum_squares += sign * (x * x + y * y);
+}
+
+// Recomputes the sums of the gesture recognizer from all slots, after the slots were filled in directly.
+void hooks_reset_gesture(NBI_Touch_Contacts *contacts) {
+    noh_assert(contacts);
+
+    // Fingers that are already down start a new gesture with the next frame.
+    contacts->gesture = (NBI_Gesture){0};
+    for (size_t i = 0; i < contacts->count; i++) {
+        if (contacts->tracking_ids[i] >= 0) hooks_sum_contact(contacts, i, 1);
+    }
+}
+
+// Pushes a value into a gesture axis of a device. If remainder is not NULL, it is added to the value, and what is left
+// after rounding the value is stored in it.
+static void hooks_add_gesture_value(NBI_Input_State *state, size_t device_index, NB_Gesture_Axis axis,
+                                    const struct timespec *time, double value, double *remainder) {
+    NBI_Axis_History *history = hooks_route_axis(state, device_index, axis, false);
+    if (history == NULL) return;
+
+    if (remainder != NULL) value += *remainder;
+    long rounded = lround(value);
+    if (remainder != NULL) *remainder = value - rounded;
+
+    hooks_add_rel_value_(history, time, (int)rounded);
+    hooks_schedule_decay(state, history, time);
+}
+
+// Updates the gesture that the fingers on a touch device are making, after a complete frame of touch events was
+// applied. Only uses the sums over the contacts, so the cost does not depend on the number of fingers.
+static void hooks_update_gesture(NBI_Input_State *state, NBI_Touch_Contacts *contacts, const struct timespec *time) {
+    NBI_Gesture *gesture = &contacts->gesture;
+    size_t fingers = gesture->active;
+
+    double slop = ((contacts->max_x - contacts->min_x) + (contacts->max_y - contacts->min_y)) * NBI_GESTURE_SLOP / 2;
+
+    if (fingers == 0) {
+        // All fingers were lifted, if they were not moving it was a tap.
+        if (gesture->fingers > 0 && gesture->kind == NBI_Gesture_None && gesture->moved <= slop &&
+            noh_diff_timespec_ns(time, &gesture->started_at) <= (int64)NBI_TAP_TIME * 1000 * 1000) {
+            hooks_add_gesture_value(state, contacts->device_index, NB_Gesture_Tap, time, gesture->max_fingers, NULL);
+        }
+        gesture->fingers = 0;
+        return;
+    }
+
+    // The center of the fingers, and their root mean square distance to it.
+    double center_x = (double)gesture->sum_x / fingers;
+    double center_y = (double)gesture->sum_y / fingers;
+    double variance = (double)gesture->sum_squares / fingers - center_x * center_x - center_y * center_y;
+    double spread = variance > 0 ? sqrt(variance) : 0;
+
+    if (gesture->fingers == 0) {
+        // The first finger touched.
+        gesture->started_at = *time;
+        gesture->max_fingers = fingers;
+        gesture->kind = NBI_Gesture_None;
+        gesture->moved = 0;
+        gesture->spread_changed = 0;
+        gesture->remainder_x = 0;
+        gesture->remainder_y = 0;
+        gesture->remainder_spread = 0;
+    } else if (fingers != gesture->fingers) {
+        // Fingers were added or lifted, which moves the center without the fingers moving. Continue from the new
+        // center and spread.
+        if (fingers > gesture->max_fingers) gesture->max_fingers = fingers;
+    } else {
+        double dx = center_x - gesture->center_x;
+        double dy = center_y - gesture->center_y;
+        double ds = spread - gesture->spread;
+        gesture->moved += hypot(dx, dy);
+        gesture->spread_changed += fabs(ds);
+
+        // Decide once which gesture it is, by whichever changed most.
+        if (fingers >= 2 && gesture->kind == NBI_Gesture_None &&
+            (gesture->moved > slop || gesture->spread_changed > slop)) {
+            gesture->kind = gesture->spread_changed > gesture->moved ? NBI_Gesture_Pinch : NBI_Gesture_Swipe;
+        }
+
+        size_t device_index = contacts->device_index;
+        if (fingers >= 2 && gesture->kind == NBI_Gesture_Swipe) {
+            bool three = fingers >= 3;
+            hooks_add_gesture_value(state, device_index, three ? NB_Gesture_Swipe_3_X : NB_Gesture_Swipe_2_X, time, dx,
+                                    &gesture->remainder_x);
+            hooks_add_gesture_value(state, device_index, three ? NB_Gesture_Swipe_3_Y : NB_Gesture_Swipe_2_Y, time, dy,
+                                    &gesture->remainder_y);
+        } else if (fingers >= 2 && gesture->kind == NBI_Gesture_Pinch) {
+            hooks_add_gesture_value(state, device_index, NB_Gesture_Pinch, time, ds, &gesture->remainder_spread);
+        }
+    }
+
+    gesture->fingers = fingers;
+    gesture->center_x = center_x;
+    gesture->center_y = center_y;
+    gesture->spread = spread;
+}
+
+///////////////////////// Event ring /////////////////////////
+
+// The kinds of events that can be passed through the event ring.
+typedef enum {
+    NBI_Key_Down,
+    NBI_Key_Up,
+    NBI_Abs_Value,
+    NBI_Rel_Value,
+    NBI_Touch_Slot, // Selects the slot that the following touch events of the device apply to.
+    NBI_Touch_Tracking_Id, // A contact starts in the current slot, or ends if the value is -1.
+    NBI_Touch_X,
+    NBI_Touch_Y,
+    NBI_Touch_Frame, // All touch events of a frame were applied, the contacts are consistent again.
+    NBI_Clear_Keys, // Releases all keys of the device, used when reloading the state of a device.
+    NBI_Device_Added // The state of the device was offered through hooks_offer_device_state.
+} NBI_Input_Event_Type;
+
+// A compact input event, as passed from the thread reading the devices to the owner of the input state.
+typedef struct {
+    struct timespec time; // When the event happened, according to the monotonic clock.
+    uint32 device_index;
+    uint16 type; // An NBI_Input_Event_Type.
+    uint16 code;
+    int value;
+} NBI_Input_Event;
+
+// A lock-free ring of input events with a single producer and a single consumer.
+// The producer only writes tail, the consumer only writes head. Both positions only ever increase and are wrapped
+// into the buffer when indexing, so head == tail means empty and tail - head == capacity means full.
+typedef struct {
+    NBI_Input_Event *elems;
+    size_t capacity; // Always a power of two.
+
+    _Alignas(64) _Atomic size_t head; // The position of the next event to read.
+    _Alignas(64) _Atomic size_t tail; // The position of the next event to write.
+
+    // The number of pushes that were rejected because the ring was full.
+    _Alignas(64) _Atomic size_t overflows;
+} NBI_Event_Ring;
+
+// Allocates the buffer of an event ring, the capacity must be a power of two.
+void hooks_ring_initialize(NBI_Event_Ring *ring, size_t capacity) {
+    noh_assert(ring);
+    noh_assert(capacity > 0 && (capacity & (capacity - 1)) == 0 && "Ring capacity must be a power of two.");
+
+    ring->elems = noh_realloc_check(ring->elems, capacity * sizeof(NBI_Input_Event));
+    ring->capacity = capacity;
+    atomic_store(&ring->head, 0);
+    atomic_store(&ring->tail, 0);
+    atomic_store(&ring->overflows, 0);
+}
+
+// Frees the buffer of an event ring.
+void hooks_ring_free(NBI_Event_Ring *ring) {
+    free(ring->elems);
+    ring->elems = NULL;
+    ring->capacity = 0;
+}
+
+// Pushes a number of events into the ring. Either all events are pushed or, if they do not fit, none are and the
+// overflow counter is increased. This way, a frame of events is never split up.
+// Must only be called from the producer thread.
+bool hooks_ring_push(NBI_Event_Ring *ring, const NBI_Input_Event *events, size_t count) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (ring->capacity - (tail - head) < count) {
+        atomic_fetch_add_explicit(&ring->overflows, 1, memory_order_relaxed);
+        return false;
+    }
+
+    size_t mask = ring->capacity - 1;
+    for (size_t i = 0; i < count; i++) {
+        ring->elems[(tail + i) & mask] = events[i];
+    }
+
+    // Publish the events to the consumer.
+    atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+    return true;
+}
+
+// States of newly added devices, offered by the thread that probed them and taken by the owner of the input state.
+static NBI_Input_State *_Atomic device_states[NBI_MAX_DEVICES];
+
+// Offers the initial state of a newly added device to the owner of the input state, which takes it when it receives
+// an NBI_Device_Added event for the device. The state must be allocated with malloc, ownership moves to the hooks.
+void hooks_offer_device_state(size_t device_index, NBI_Input_State *device_state) {
+    noh_assert(device_index < NBI_MAX_DEVICES);
+
+    NBI_Input_State *old_state = atomic_exchange(&device_states[device_index], device_state);
+    if (old_state != NULL) {
+        // The device was added again before its previous state was taken, that state is outdated.
+        hooks_free_state(old_state);
+        free(old_state);
+    }
+}
+
+// Moves all lists of another state to the end of the lists of the input state, and frees the lists of the other state.
+// The routes of the input state are not updated.
+void hooks_merge_state(NBI_Input_State *state, NBI_Input_State *other) {
+    // The elements of the lists now belong to state.
+    for (size_t i = 0; i < other->pressed_keys.count; i++) {
+        noh_da_append(&state->pressed_keys, other->pressed_keys.elems[i]);
+    }
+    for (size_t i = 0; i < other->axes.count; i++) {
+        noh_da_append(&state->axes, other->axes.elems[i]);
+    }
+    for (size_t i = 0; i < other->touches.count; i++) {
+        noh_da_append(&state->touches, other->touches.elems[i]);
+    }
+
+    noh_da_free(&other->pressed_keys);
+    noh_da_free(&other->axes);
+    noh_da_free(&other->touches);
+}
+
+// Replaces all lists of a device in the input state with the lists from its offered state, if any.
+static void hooks_take_device_state(NBI_Input_State *state, size_t device_index) {
+    NBI_Input_State *device_state = atomic_exchange(&device_states[device_index], NULL);
+    if (device_state == NULL) return; // Already taken after an earlier event.
+
+    // Remove the lists from when the device was connected before, if any. The key statistics carry over to the new
+    // list, so they survive reconnecting the device.
+    for (size_t i = state->pressed_keys.count; i > 0; i--) {
+        NBI_Pressed_Keys_List *list = &state->pressed_keys.elems[i - 1];
+        if (list->device_index != device_index) continue;
+
+        for (size_t j = 0; j < device_state->pressed_keys.count; j++) {
+            NBI_Pressed_Keys_List *new_list = &device_state->pressed_keys.elems[j];
+            if (new_list->device_index == device_index) hooks_move_key_stats(new_list, list);
         }
+
+        hooks_free_key_list(list);
+        noh_da_remove_at(&state->pressed_keys, i - 1);
+    }
+
+    for (size_t i = state->axes.count; i > 0; i--) {
+        NBI_Axis_History *history = &state->axes.elems[i - 1];
+        if (history->device_index != device_index) continue;
+        free(history->elems);
+        noh_da_remove_at(&state->axes, i - 1);
+    }
+
+    for (size_t i = state->touches.count; i > 0; i--) {
+        NBI_Touch_Contacts *contacts = &state->touches.elems[i - 1];
+        if (contacts->device_index != device_index) continue;
+        free(contacts->tracking_ids);
+        noh_da_remove_at(&state->touches, i - 1);
+    }
+
+    hooks_merge_state(state, device_state);
+    free(device_state);
+
+    // Lists were moved, so every route needs to be updated.
+    hooks_build_routes(state);
+}
+
+// Applies a touch event to the contacts of a multi-touch device.
+static void hooks_add_touch_value(NBI_Input_State *state, size_t device_index, NBI_Input_Event_Type type, const struct timespec *time, int value) {
+    NBI_Touch_Contacts *contacts = hooks_route_touches(state, device_index);
+    if (contacts == NULL) {
+        noh_log(NOH_WARNING, "Could not find touch contacts of device %zu.", device_index);
+        return;
+    }
+
+    if (type == NBI_Touch_Frame) {
+        hooks_update_gesture(state, contacts, time);
+        return;
+    }
+
+    if (type == NBI_Touch_Slot) {
+        // Slots beyond the ones we track, or negative ones, select nothing.
+        contacts->current_slot = value >= 0 ? (size_t)value : contacts->count;
+        return;
+    }
+
+    size_t slot = contacts->current_slot;
+    if (slot >= contacts->count) return;
+
+    // Keep the sums of the gesture recognizer up to date by taking the contact out and putting it back in.
+    bool was_active = contacts->tracking_ids[slot] >= 0;
+    if (was_active) hooks_sum_contact(contacts, slot, -1);
+
+    switch (type) {
+        case NBI_Touch_Tracking_Id:
+            contacts->tracking_ids[slot] = value;
+            break;
+        case NBI_Touch_X:
+            contacts->x[slot] = value;
+            break;
+        case NBI_Touch_Y:
+            contacts->y[slot] = value;
+            break;
+        default:
+            break;
+    }
+
+    if (contacts->tracking_ids[slot] >= 0) hooks_sum_contact(contacts, slot, 1);
+}
+
+// Applies a single event from the ring to the input state.
+void hooks_apply_event(NBI_Input_State *state, const NBI_Input_Event *event) {
+    // Remember the earliest event of the next snapshot, for measuring the latency until it is shown.
+    int64 event_time = (int64)event->time.tv_sec * 1000 * 1000 * 1000 + event->time.tv_nsec;
+    if (event->type != NBI_Device_Added && (state->pending_input_time == 0 || event_time < state->pending_input_time)) {
+        state->pending_input_time = event_time;
+    }
+
+    switch (event->type) {
+        case NBI_Key_Down:
+            hooks_add_key(state, event->device_index, event->code, true, event_time);
+            break;
+        case NBI_Key_Up:
+            hooks_add_key(state, event->device_index, event->code, false, event_time);
+            break;
+        case NBI_Abs_Value:
+            hooks_add_abs_value(state, event->device_index, event->code, &event->time, event->value);
+            break;
+        case NBI_Rel_Value:
+            hooks_add_rel_value(state, event->device_index, event->code, &event->time, event->value);
+            break;
+        case NBI_Touch_Slot:
+        case NBI_Touch_Tracking_Id:
+        case NBI_Touch_X:
+        case NBI_Touch_Y:
+        case NBI_Touch_Frame:
+            hooks_add_touch_value(state, event->device_index, event->type, &event->time, event->value);
+            break;
+        case NBI_Clear_Keys: {
+            NBI_Pressed_Keys_List *list = hooks_route_key_list(state, event->device_index);
+            if (list != NULL) hooks_clear_keys_(list);
+            break;
+        }
+        case NBI_Device_Added:
+            hooks_take_device_state(state, event->device_index);
+            break;
+        default:
+            noh_assert(false && "Invalid input event type.");
+            break;
+    }
+}
+
+// Applies all events that are currently in the ring to the input state, returns the number of events applied.
+// Must only be called from the consumer thread.
+size_t hooks_ring_drain(NBI_Event_Ring *ring, NBI_Input_State *state) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    size_t mask = ring->capacity - 1;
+    for (size_t pos = head; pos != tail; pos++) {
+        hooks_apply_event(state, &ring->elems[pos & mask]);
     }
 
-    // The axis was not found, log a warning.
-    noh_log(NOH_WARNING, "Could not find axis %hu of device %zu for entering rel value.", axis_id, device_index);
+    // Hand the space back to the producer.
+    atomic_store_explicit(&ring->head, tail, memory_order_release);
+    return tail - head;
 }
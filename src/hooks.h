@@ -41,12 +41,26 @@ typedef struct {
 
 ///////////////////////// Keyboard state /////////////////////////
 
+// Statistics of a single key of a device, since the key was first pressed.
+typedef struct {
+    uint16 key; // The key code.
+    uint32 presses; // The number of times the key was pressed.
+    uint32 releases; // The number of presses that ended, hold_time is the total over these.
+    int64 hold_time; // The total time in nanoseconds the key was held, hold_time / releases is the average.
+    int64 pressed_at; // The monotonic time in nanoseconds at which the key was pressed, 0 if it is not held.
+} NB_Key_Stats;
+
 // The pressed keys of a specific device.
 typedef struct {
     uint16 *elems; // The key codes of the currently pressed keys.
     size_t count; // The number of elements in elems.
 
     size_t device_index; // Index of the device in the devices list for which the pressed keys are recorded.
+
+    NB_Key_Stats *stats; // The statistics of every key that was pressed at least once, in the order of first press.
+    size_t stats_count; // The number of elements in stats.
+    uint64 presses; // The number of key presses on this device.
+    uint32 keys_per_second; // The number of key presses on this device in the last second.
 } NB_Pressed_Keys_List;
 
 // A list of lists of pressed keys, one per device. Every device has only one list of pressed keys.
@@ -80,28 +94,154 @@ typedef struct {
     size_t count; // The number of elements in elems.
 } NB_Axis_Histories;
 
+///////////////////////// Touch state /////////////////////////
+
+// The contacts on a multi-touch device, such as the fingers on a touchpad. The device tracks every contact in its own
+// slot, all arrays have one element per slot.
+typedef struct {
+    int *tracking_ids; // The identifier of the contact in each slot, or -1 if there is no contact in the slot.
+    int *x; // The horizontal position of the contact in each slot.
+    int *y; // The vertical position of the contact in each slot.
+    size_t count; // The number of slots, the number of elements in each of the arrays.
+
+    int min_x; // The minimum horizontal position.
+    int max_x; // The maximum horizontal position.
+    int min_y; // The minimum vertical position.
+    int max_y; // The maximum vertical position.
+
+    size_t device_index; // Index in the list of devices of the device for which the contacts are recorded.
+} NB_Touch_Contacts;
+
+// Synthetic relative axes of multi-touch devices, fed by the gesture recognizer in the hooks. They are reported as
+// axis histories of the device, like its real axes, with ids above the ids of all real axes.
+typedef enum {
+    NB_Gesture_Swipe_2_X = 0x100, // Horizontal movement of two fingers moving together.
+    NB_Gesture_Swipe_2_Y, // Vertical movement of two fingers moving together.
+    NB_Gesture_Swipe_3_X, // Horizontal movement of three or more fingers moving together.
+    NB_Gesture_Swipe_3_Y, // Vertical movement of three or more fingers moving together.
+    NB_Gesture_Pinch, // Change in distance between two or more fingers, positive when they move apart.
+    NB_Gesture_Tap, // The number of fingers of a tap, reported when the fingers are lifted.
+    NB_Gesture_End
+} NB_Gesture_Axis;
+
+// The number of gesture axes.
+#define NB_GESTURE_AXES (NB_Gesture_End - NB_Gesture_Swipe_2_X)
+
+// A list of the contacts of all multi-touch devices, one per device.
+typedef struct {
+    NB_Touch_Contacts *elems;
+    size_t count; // The number of elements in elems.
+} NB_Touch_Contacts_Lists;
+
 // The complete input state.
 typedef struct {
     NB_Pressed_Keys_Lists pressed_keys;
     NB_Axis_Histories axes;
+    NB_Touch_Contacts_Lists touches;
+
+    // The number of times input events had to be dropped because they were not consumed fast enough.
+    size_t event_overflows;
+
+    // Increases with every new snapshot of the state, so a reader can tell whether the state changed since it last
+    // looked.
+    uint64 generation;
+
+    // The monotonic time in nanoseconds at which the earliest input event happened that is reflected in this state but
+    // not in the state that hooks_get_state returned before, or 0 if there is none. A UI can compare this to the time
+    // at which it has shown the state, to measure the latency from input to screen.
+    int64 input_time;
 } NB_Input_State;
 
+///////////////////////// Configuration /////////////////////////
+
+// The ways in which input can be read from the devices.
+typedef enum {
+    NB_Backend_Auto, // Use io_uring if the kernel supports it, epoll otherwise.
+    NB_Backend_Epoll, // Wait for input with epoll, and read every device that has input available.
+    NB_Backend_Io_Uring, // Keep a read in flight on every device with io_uring. Fails to initialize if not supported.
+    NB_Backend_Replay // Replay the input in the recording at replay_path, instead of reading the devices.
+} NB_Hooks_Backend;
+
+// How the run thread, which reads the devices, is scheduled.
+typedef enum {
+    NB_Scheduling_Default, // The normal time sharing scheduling of the system.
+    NB_Scheduling_Fifo, // Real-time: runs as soon as there is input, ahead of all threads that are not real-time.
+    NB_Scheduling_Round_Robin // Real-time like Fifo, but takes turns with other real-time threads of the same priority.
+} NB_Hooks_Scheduling;
+
+// Options for initializing the hooks. A zero initialized config uses the defaults.
+typedef struct {
+    NB_Hooks_Backend backend;
+
+    // If above 1, the values of absolute axes are rounded to a multiple of this step from the minimum of the axis, so
+    // changes smaller than the step don't update the state.
+    int abs_quantization;
+
+    // If set, every event read from the devices is written to this file, so it can be replayed later.
+    const char *record_path;
+
+    // The recording to replay with NB_Backend_Replay.
+    const char *replay_path;
+
+    // Whether to replay as fast as the events can be read, instead of with the timing of the recording.
+    bool replay_fast;
+
+    // The file that the capabilities of the devices are cached in. If not set, devices.cache in the nohboard directory
+    // of the user's cache directory.
+    const char *cache_path;
+
+    // How the run thread is scheduled, with its real-time priority from 1 to 99, or 0 for the lowest. Real-time
+    // scheduling needs CAP_SYS_NICE or a high enough RLIMIT_RTPRIO, otherwise the default scheduling is kept.
+    NB_Hooks_Scheduling run_scheduling;
+    int run_priority;
+
+    // The CPUs that the run and state threads may run on, one bit per CPU starting from CPU 0. 0 for any CPU.
+    uint64 run_cpus;
+    uint64 state_cpus;
+
+    // Whether to lock all memory of the process as it is used, so the run thread never waits for a page to be read
+    // back in. Needs CAP_IPC_LOCK or a high enough RLIMIT_MEMLOCK, otherwise memory is not locked.
+    bool lock_memory;
+} NB_Hooks_Config;
+
+// How long after the kernel received them the run thread handled events, which shows how long it waits to be
+// scheduled. In microseconds.
+typedef struct {
+    size_t count; // The number of reads measured.
+    double p50;
+    double p99;
+    double max;
+} NB_Hooks_Jitter;
+
 ///////////////////////// Functions /////////////////////////
 
 // Returns the full current state of all monitored input devices.
 // The arena is used to allocate all strings and unknown length lists in. When the arena is reset or freed,
 // the returned NB_Input_State is no longer valid.
+// Never takes a lock, and can be called from any number of threads at the same time.
 NB_Input_State hooks_get_state(Noh_Arena *arena);
 
 // Initialize hooks and start listening to input events.
-bool hooks_initialize();
+bool hooks_initialize(NB_Hooks_Config config);
 
-// Re-initialize hooks and start listening to input events.
+// Re-initialize hooks with the same configuration and start listening to input events.
 bool hooks_reinitialize();
 
 // Shutdown hooks and stop listening to input events.
 void hooks_shutdown();
 
+// Returns the generation of the latest input state, which is the generation hooks_get_state would return now. Much
+// cheaper than getting the state, to find out whether it changed.
+uint64 hooks_get_generation();
+
+// Returns an eventfd that becomes readable whenever the input state changes, including when axes decay or keys are
+// cleaned up. Read its 8 byte counter to reset it. A UI can wait on it to only draw when there is something new, it
+// stays the same file descriptor when reinitializing the hooks. Returns -1 if the hooks were never initialized.
+int hooks_get_change_fd();
+
+// Returns the scheduling jitter of the run thread since the hooks were initialized.
+NB_Hooks_Jitter hooks_get_jitter();
+
 // Finds the device with the specified index, returns null if there is no device at this index.
 NB_Input_Device *hooks_find_device_by_index(size_t device_index);
 
@@ -1,488 +1,2946 @@
 #include <unistd.h>
 #include <stdint.h>
-#include <semaphore.h>
 #include <pthread.h>
 #include <linux/input.h>
 #include <linux/input-event-codes.h>
 #include <fcntl.h>
-#include <poll.h>
 #include <dirent.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+// Also includes noh.h
+#include "hooks.c" // Common code used by all platforms.
+
+static bool running = false;
+
+// This arena is used all throughout this file for storing temporary data.
+static Noh_Arena hooks_arena = {0};
+
+NB_Input_Devices hooks_devices = {0};
+
+// The epoll instance that watches all device file descriptors, and the wake_fd. The data of every registered event
+// is a pointer to the NB_Input_Device it belongs to, or NULL for the wake_fd.
+static int epoll_fd = -1;
+// An eventfd that is written to in order to wake up the run thread, e.g. when shutting down.
+static int wake_fd = -1;
+// Watches the input directory for devices being added or removed. Its epoll event data is a pointer to inotify_fd.
+static int inotify_fd = -1;
+
+#define INPUT_BASE_PATH "/dev/input"
+
+// An eventfd that is written to whenever there are new events for the state thread, or when it should stop.
+static int state_fd = -1;
+// A timerfd that wakes up the state thread when the next axis should decay or the pressed keys should be checked.
+static int state_timer_fd = -1;
+static pthread_t state_thread;
+// An eventfd that is written to whenever a new snapshot is published, for a UI that sleeps until the input changes.
+// It is created once and kept when reinitializing, so the UI can keep waiting on the same file descriptor.
+static int change_fd = -1;
+
+static pthread_t run_thread;
+
+// The configuration the hooks were initialized with, used again when reinitializing.
+static NB_Hooks_Config hooks_config = {0};
+
+// The backend that the run thread actually uses to read from the devices, never NB_Backend_Auto.
+static NB_Hooks_Backend hooks_backend = NB_Backend_Epoll;
+
+// Lets the state thread know there are new events, or that it should stop.
+static void wake_state() {
+    uint64_t wakeup = 1;
+    if (write(state_fd, &wakeup, sizeof(wakeup)) < 0) {
+        noh_log(NOH_WARNING, "Failed to wake up state thread: %s", strerror(errno));
+    }
+}
+
+// Lets a UI waiting on change_fd know that a new snapshot was published.
+static void notify_change() {
+    uint64_t wakeup = 1;
+    if (write(change_fd, &wakeup, sizeof(wakeup)) < 0 && errno != EAGAIN) {
+        noh_log(NOH_WARNING, "Failed to notify input state change: %s", strerror(errno));
+    }
+}
+
+// An input event from a /dev/input file stream.
+typedef struct {
+    struct timeval time;
+    uint16 type;
+    uint16 code;
+    uint value;
+} Input_Event;
+
+// The maximum number of events that is read from a single device in one go. A full hardware frame (all events up to
+// a SYN_REPORT) should fit in here, multi-touch frames can easily contain a few dozen events.
+#define HOOKS_EVENT_BATCH 128
+
+// Filters the noise from the values of an absolute axis, before they are passed on to the state.
+typedef struct {
+    bool enabled; // Whether the device has this axis.
+
+    int minimum;
+    int maximum;
+    int flat; // Values at most this far from the center of the axis are reported as the center.
+    int fuzz; // Changes smaller than this are considered noise, and are not passed on.
+
+    int last_value; // The last value that was passed on.
+} Input_Axis_Filter;
+
+// The events read from a single device, before they are applied to the input state.
+// Events are only applied per complete frame, events after the last SYN_REPORT remain in the batch until the rest of
+// their frame has been read.
+typedef struct {
+    Input_Event elems[HOOKS_EVENT_BATCH];
+    size_t count; // The number of events in elems.
+    size_t committed; // The number of events at the start of elems that form complete frames, ready to be applied.
+
+    bool dropping; // Set after a SYN_DROPPED, all events are discarded until the next SYN_REPORT.
+    bool needs_resync; // Set when events were dropped, the device state should be reloaded from the device.
+    bool needs_announce; // Set when the device was added, but the state thread could not be notified yet.
+
+    // Whether the kernel timestamps events of this device with the monotonic clock. If not, events are timestamped
+    // when they are read.
+    bool monotonic_time;
+
+    // The filters of the absolute axes of the device, by axis id.
+    Input_Axis_Filter abs_filters[ABS_CNT];
+
+    // Whether the device tracks multi-touch contacts in slots. Its multi-touch events are then passed on as touch
+    // events rather than as absolute axis values.
+    bool has_slots;
+} Input_Event_Batch;
+
+// One batch per device, at the same index as the device. Allocated for the maximum number of devices, so devices
+// can be added without moving the batches.
+static Input_Event_Batch *event_batches;
+
+// The number of events that fit in the event ring. At 60 frames per second, this is enough for a few devices reporting
+// at 8 kHz.
+#define HOOKS_RING_CAPACITY (8 KB)
+
+// Passes the events from the run thread to the state thread. The run thread is the only producer, and the state
+// thread the only consumer, so the run thread never has to wait for the state to be copied.
+static NBI_Event_Ring event_ring = {0};
+
+// The input state is only modified by the state thread, which publishes snapshots of it for hooks_get_state.
+NBI_Input_State input_state = {0};
+
+// The capacity of each snapshot buffer. This is only reserved address space, memory is only used for the part of the
+// buffers that snapshots actually fill.
+#define HOOKS_SNAPSHOT_CAPACITY (16 MB)
+
+// The published snapshots of input_state. The buffers are allocated once and never freed, since a reader could be
+// copying from them at any time.
+static NBI_Snapshots snapshots = {0};
+
+///////////////////////// Device sources /////////////////////////
+
+// Where the input devices come from. Every device of a source has a file descriptor that reads as a stream of
+// Input_Events, like an evdev device, so the run thread reads all devices the same way with either backend. What else
+// the hooks need to know about a device is queried with the evdev ioctls, through the source.
+typedef struct {
+    // Fills in the list of devices when the hooks are initialized.
+    bool (*init_devices)(Noh_Arena *arena, NB_Input_Devices *devices);
+
+    // Performs an evdev ioctl on a device.
+    int (*query)(NB_Input_Device *dev, unsigned long request, void *arg);
+
+    // Starts producing input, once the run thread is running. Can be NULL.
+    bool (*start)();
+
+    // Stops producing input and frees the devices, once the run and state threads have stopped. Can be NULL.
+    void (*stop)();
+
+    // Whether devices are added and removed by watching the input directory.
+    bool hotplug;
+} Hooks_Device_Source;
+
+// The devices in /dev/input.
+static const Hooks_Device_Source evdev_source;
+
+// The source of the devices the hooks are initialized with.
+static const Hooks_Device_Source *hooks_source = &evdev_source;
+
+// Everything the hooks query from a device with ioctls. Devices of sources other than evdev are described by this,
+// and their queries are answered from it. Also how devices are stored in a recording.
+typedef struct {
+    char name[256];
+    char phys[256];
+    char path[256];
+
+    uint8 ev_bits[EV_CNT / 8]; // The supported event types.
+    uint8 key_bits[KEY_CNT / 8]; // The supported keys.
+    uint8 abs_bits[ABS_CNT / 8]; // The supported absolute axes.
+    uint8 rel_bits[REL_CNT / 8]; // The supported relative axes.
+
+    // The keys that are pressed. Kept up to date by whoever writes the events of the device, so the keys can be
+    // checked by cleanup_keys. Only accessed atomically.
+    uint8 pressed[KEY_CNT / 8];
+
+    struct input_absinfo abs_info[ABS_CNT]; // The information of every supported absolute axis.
+    int32 slots[3][NBI_MAX_TOUCH_SLOTS]; // The tracking id, x and y of the contact in every slot.
+} Hooks_Device_Description;
+
+// The descriptions of the devices of the current source, by device index. NULL for evdev devices.
+static Hooks_Device_Description *described_devices[NBI_MAX_DEVICES];
+
+// Copies a field of a device description into the buffer of an ioctl, zeroing the rest of the buffer like the kernel
+// leaves it when the caller zeroed it. Returns the number of bytes copied, like the kernel.
+static int copy_described(void *arg, size_t size, const void *field, size_t field_size) {
+    size_t copied = size < field_size ? size : field_size;
+    memset(arg, 0, size);
+    memcpy(arg, field, copied);
+    return copied;
+}
+
+// Answers the ioctls the hooks use on evdev devices from the description of a device.
+static int described_device_query(NB_Input_Device *dev, unsigned long request, void *arg) {
+    Hooks_Device_Description *described = described_devices[dev->index];
+    if (described == NULL) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    size_t size = _IOC_SIZE(request);
+    unsigned int nr = _IOC_NR(request);
+
+    // Described devices are written to with monotonic timestamps, and only with events that would not be masked.
+    if (request == EVIOCSCLOCKID || request == EVIOCSMASK) return 0;
+
+    if (_IOC_TYPE(request) != 'E' || _IOC_DIR(request) != _IOC_READ) {
+        errno = ENOTTY;
+        return -1;
+    }
+
+    if (nr >= _IOC_NR(EVIOCGABS(0)) && nr < _IOC_NR(EVIOCGABS(ABS_CNT))) {
+        copy_described(arg, size, &described->abs_info[nr - _IOC_NR(EVIOCGABS(0))], sizeof(struct input_absinfo));
+        return 0;
+    }
+
+    if (nr == _IOC_NR(EVIOCGBIT(0, 0))) return copy_described(arg, size, described->ev_bits, sizeof(described->ev_bits));
+    if (nr == _IOC_NR(EVIOCGBIT(EV_KEY, 0))) return copy_described(arg, size, described->key_bits, sizeof(described->key_bits));
+    if (nr == _IOC_NR(EVIOCGBIT(EV_ABS, 0))) return copy_described(arg, size, described->abs_bits, sizeof(described->abs_bits));
+    if (nr == _IOC_NR(EVIOCGBIT(EV_REL, 0))) return copy_described(arg, size, described->rel_bits, sizeof(described->rel_bits));
+    if (nr > _IOC_NR(EVIOCGBIT(0, 0)) && nr <= _IOC_NR(EVIOCGBIT(EV_MAX, 0))) {
+        // Other event types are not described, so the device has none of their codes.
+        memset(arg, 0, size);
+        return 0;
+    }
+    if (nr == _IOC_NR(EVIOCGNAME(0))) return copy_described(arg, size, described->name, sizeof(described->name));
+    if (nr == _IOC_NR(EVIOCGPHYS(0))) return copy_described(arg, size, described->phys, sizeof(described->phys));
+
+    if (nr == _IOC_NR(EVIOCGKEY(0))) {
+        uint8 *keys = arg;
+        memset(keys, 0, size);
+        for (size_t i = 0; i < size && i < sizeof(described->pressed); i++) {
+            keys[i] = __atomic_load_n(&described->pressed[i], __ATOMIC_RELAXED);
+        }
+        return size < sizeof(described->pressed) ? size : sizeof(described->pressed);
+    }
+
+    if (nr == _IOC_NR(EVIOCGMTSLOTS(0)) && size >= sizeof(int32)) {
+        // The request starts with the code, the values of the slots go after it.
+        int32 *request_values = arg;
+        size_t slot_count = size / sizeof(int32) - 1;
+        if (slot_count > NBI_MAX_TOUCH_SLOTS) slot_count = NBI_MAX_TOUCH_SLOTS;
+
+        int32 *values = NULL;
+        if (request_values[0] == ABS_MT_TRACKING_ID) values = described->slots[0];
+        if (request_values[0] == ABS_MT_POSITION_X) values = described->slots[1];
+        if (request_values[0] == ABS_MT_POSITION_Y) values = described->slots[2];
+
+        for (size_t i = 0; i < slot_count; i++) request_values[i + 1] = values != NULL ? values[i] : 0;
+        return 0;
+    }
+
+    errno = ENOTTY;
+    return -1;
+}
+
+static bool test_bit(const uint8 *keymap, size_t keymap_len, uint16 key) {
+    if (key / 8 >= keymap_len) return false;
+
+    size_t index = key / 8;
+    uint8 offset = key % 8;
+    return (keymap[index] & (1 << offset)) > 0;
+}
+
+// Returns the first bit from the specified bit on that is set in a bitmap, or the number of bits in the bitmap if
+// there is none. Skips over 64 bits at a time, since most of the bits of a device's capabilities are not set.
+static size_t next_bit(const uint8 *bitmap, size_t bitmap_len, size_t from) {
+    size_t bits = bitmap_len * 8;
+    while (from < bits) {
+        size_t word_index = from / 64;
+        size_t word_bytes = bitmap_len - word_index * 8 < 8 ? bitmap_len - word_index * 8 : 8;
+
+        // The bitmaps are arrays of longs in native byte order, as the kernel fills them in.
+        uint64 word = 0;
+        memcpy(&word, bitmap + word_index * 8, word_bytes);
+        word &= ~(uint64)0 << (from % 64);
+        if (word != 0) return word_index * 64 + __builtin_ctzll(word);
+
+        from = (word_index + 1) * 64;
+    }
+
+    return bits;
+}
+
+// Loops over the bits that are set in a bitmap array, from the first bit on and below the limit.
+#define for_each_set_bit(bit, bitmap, first, limit)                                        \
+    for (size_t bit = next_bit((bitmap), sizeof(bitmap), (first)); bit < (size_t)(limit); \
+         bit = next_bit((bitmap), sizeof(bitmap), bit + 1))
+
+///////////////////////// Capability cache /////////////////////////
+
+// The capabilities of evdev devices are cached in a file, so they don't have to be queried from every device every
+// time the hooks are initialized. A device is identified by its EVIOCGID, physical path and name. The cache also
+// remembers the index of every device, so a device keeps its index between runs even when it is connected later.
+
+#define HOOKS_CACHE_MAGIC "NBCAP002"
+
+// Devices that were not connected for this long are dropped from the cache, in seconds.
+#define HOOKS_CACHE_EXPIRY (30 * 24 * 60 * 60)
+
+// How outdated the time a device was last connected may be, in seconds. Keeps the cache from being written every run.
+#define HOOKS_CACHE_SEEN_INTERVAL (24 * 60 * 60)
+
+// The size in bytes of a bitmap of capabilities, rounded up to whole 64-bit words so it can be scanned a word at a time.
+#define HOOKS_BITMAP_SIZE(bits) (((bits) + 63) / 64 * 8)
+
+// A device in the capability cache.
+typedef struct {
+    struct input_id id;
+    char name[256];
+    char phys[256];
+
+    uint32 index; // The index of the device.
+    int32 type; // The NB_Input_Device_Type of the device.
+    int64 last_seen; // The wall clock time in seconds at which the device was last connected.
+
+    uint8 ev_bits[HOOKS_BITMAP_SIZE(EV_CNT)];
+    uint8 key_bits[HOOKS_BITMAP_SIZE(KEY_CNT)];
+    uint8 abs_bits[HOOKS_BITMAP_SIZE(ABS_CNT)];
+    uint8 rel_bits[HOOKS_BITMAP_SIZE(REL_CNT)];
+    struct input_absinfo abs_info[ABS_CNT]; // The ranges of the absolute axes, their values are always queried.
+
+    uint64 key_hash; // The hash_bitmap of key_bits, compared when the device is opened.
+} Hooks_Cached_Device;
+
+typedef struct {
+    char magic[sizeof(HOOKS_CACHE_MAGIC) - 1];
+    uint32 entry_size; // The size of a Hooks_Cached_Device, a cache with a different layout is not used.
+    uint32 count; // The number of devices following the header.
+} Hooks_Cache_Header;
+
+// The cache file as it was when the hooks were initialized, mapped into memory until they shut down.
+static void *cache_map = NULL;
+static size_t cache_map_size = 0;
+
+// The entry of every evdev device in the cache, by index, also for devices that are not connected. The capabilities
+// of a device are answered from its entry. NULL if there is no entry for the index.
+static const Hooks_Cached_Device *cached_devices[NBI_MAX_DEVICES];
+
+// The entries that were created since the cache was mapped, freed when the hooks shut down.
+typedef struct {
+    Hooks_Cached_Device **elems;
+    size_t count;
+    size_t capacity;
+} Hooks_Cached_Devices;
+
+static Hooks_Cached_Devices cache_created = {0};
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Whether any entry changed since the cache was mapped. Only accessed atomically.
+static bool cache_dirty = false;
+
+// Tries to determine the type of a device based on its name.
+// Later we can use key and relative events to add another way to determine.
+// FUTURE: Is there not a better way to find this out?
+static NB_Input_Device_Type device_type_from_name(const char *name) {
+    NB_Input_Device_Type type = NB_Unknown;
+    if (noh_sv_contains_ci(noh_sv_from_cstr(name), noh_sv_from_cstr("mouse"))) type = NB_Mouse;
+    if (noh_sv_contains_ci(noh_sv_from_cstr(name), noh_sv_from_cstr("keyboard"))) type = NB_Keyboard;
+    if (noh_sv_contains_ci(noh_sv_from_cstr(name), noh_sv_from_cstr("touchpad"))) type = NB_Touchpad;
+    return type;
+}
+
+// Returns the path of the cache file, from the configuration or in the user's cache directory. Returns false if there
+// is no cache directory.
+static bool cache_file_path(char *path, size_t size) {
+    int length;
+    if (hooks_config.cache_path != NULL) {
+        length = snprintf(path, size, "%s", hooks_config.cache_path);
+    } else if (getenv("XDG_CACHE_HOME") != NULL && getenv("XDG_CACHE_HOME")[0] != '\0') {
+        length = snprintf(path, size, "%s/nohboard/devices.cache", getenv("XDG_CACHE_HOME"));
+    } else if (getenv("HOME") != NULL) {
+        length = snprintf(path, size, "%s/.cache/nohboard/devices.cache", getenv("HOME"));
+    } else {
+        return false;
+    }
+
+    return length > 0 && (size_t)length < size;
+}
+
+// Returns whether an entry describes the device with the specified identity.
+static bool cached_device_is(const Hooks_Cached_Device *cached, const struct input_id *id, const char *name,
+                             const char *phys) {
+    return memcmp(&cached->id, id, sizeof(struct input_id)) == 0 && strcmp(cached->name, name) == 0 &&
+           strcmp(cached->phys, phys) == 0;
+}
+
+// A cheap FNV-1a hash of a bitmap of capabilities.
+static uint64 hash_bitmap(const uint8 *bitmap, size_t size) {
+    uint64 hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < size; i++) hash = (hash ^ bitmap[i]) * 0x100000001b3;
+    return hash;
+}
+
+// Adds a new entry to the cache, with the contents of the specified entry.
+static const Hooks_Cached_Device *create_cached_device(const Hooks_Cached_Device *contents) {
+    Hooks_Cached_Device *cached = noh_realloc_check(NULL, sizeof(Hooks_Cached_Device));
+    *cached = *contents;
+
+    pthread_mutex_lock(&cache_mutex);
+    noh_da_append(&cache_created, cached);
+    pthread_mutex_unlock(&cache_mutex);
+
+    __atomic_store_n(&cache_dirty, true, __ATOMIC_RELAXED);
+    return cached;
+}
+
+// Queries the capabilities of an evdev device and adds them to the cache. What cannot be queried stays empty.
+static const Hooks_Cached_Device *cache_device(int fd, const struct input_id *id, const char *name, const char *phys) {
+    Hooks_Cached_Device cached = { .id = *id, .type = device_type_from_name(name), .last_seen = time(NULL) };
+    strncpy(cached.name, name, sizeof(cached.name) - 1);
+    strncpy(cached.phys, phys, sizeof(cached.phys) - 1);
+
+    ioctl(fd, EVIOCGBIT(0, sizeof(cached.ev_bits)), cached.ev_bits);
+    ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(cached.key_bits)), cached.key_bits);
+    ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(cached.abs_bits)), cached.abs_bits);
+    ioctl(fd, EVIOCGBIT(EV_REL, sizeof(cached.rel_bits)), cached.rel_bits);
+
+    for_each_set_bit(axis_id, cached.abs_bits, 0, ABS_CNT) {
+        ioctl(fd, EVIOCGABS(axis_id), &cached.abs_info[axis_id]);
+        cached.abs_info[axis_id].value = 0;
+    }
+
+    cached.key_hash = hash_bitmap(cached.key_bits, sizeof(cached.key_bits));
+    return create_cached_device(&cached);
+}
+
+// Returns whether the event types and keys of an opened device are still those in its entry. This costs two ioctls,
+// the rest of the capabilities are only checked as far as the ranges of absolute axes, when their values are queried.
+static bool cached_device_current(int fd, const Hooks_Cached_Device *cached) {
+    uint8 ev_bits[HOOKS_BITMAP_SIZE(EV_CNT)] = {0};
+    if (ioctl(fd, EVIOCGBIT(0, sizeof(ev_bits)), ev_bits) < 0) return false;
+    if (memcmp(ev_bits, cached->ev_bits, sizeof(ev_bits)) != 0) return false;
+
+    uint8 key_bits[HOOKS_BITMAP_SIZE(KEY_CNT)] = {0};
+    if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(key_bits)), key_bits) < 0) return false;
+    return hash_bitmap(key_bits, sizeof(key_bits)) == cached->key_hash;
+}
+
+// Returns whether an entry of the cache file can be used. Entries are only checked once they are needed.
+static bool cached_device_valid(const Hooks_Cached_Device *cached) {
+    return cached->index < NBI_MAX_DEVICES && memchr(cached->name, '\0', sizeof(cached->name)) != NULL &&
+           memchr(cached->phys, '\0', sizeof(cached->phys)) != NULL;
+}
+
+// Returns the entry of the cache file for the device with the specified identity, or NULL if it has none.
+static const Hooks_Cached_Device *find_cached_device(const struct input_id *id, const char *name, const char *phys) {
+    if (cache_map == NULL) return NULL;
+
+    const Hooks_Cache_Header *header = cache_map;
+    const Hooks_Cached_Device *entries = (const Hooks_Cached_Device *)(header + 1);
+    for (size_t i = 0; i < header->count; i++) {
+        if (cached_device_valid(&entries[i]) && cached_device_is(&entries[i], id, name, phys)) return &entries[i];
+    }
+
+    return NULL;
+}
+
+// Maps the cache file into memory, and adds the devices in it to the list of devices as not connected, so connected
+// devices get back the index they had. Without a usable cache file, all devices are queried.
+static void load_capability_cache(Noh_Arena *arena, NB_Input_Devices *devices) {
+    char path[PATH_MAX];
+    if (!cache_file_path(path, sizeof(path))) return;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return; // Nothing cached yet.
+
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) < 0 || (size_t)statbuf.st_size < sizeof(Hooks_Cache_Header)) {
+        close(fd);
+        return;
+    }
+
+    void *map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        noh_log(NOH_WARNING, "Could not map device cache %s: %s", path, strerror(errno));
+        return;
+    }
+
+    const Hooks_Cache_Header *header = map;
+    if (memcmp(header->magic, HOOKS_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->entry_size != sizeof(Hooks_Cached_Device) ||
+        (size_t)statbuf.st_size != sizeof(Hooks_Cache_Header) + (size_t)header->count * sizeof(Hooks_Cached_Device)) {
+        noh_log(NOH_INFO, "Not using outdated device cache %s.", path);
+        munmap(map, statbuf.st_size);
+        return;
+    }
+
+    cache_map = map;
+    cache_map_size = statbuf.st_size;
+
+    const Hooks_Cached_Device *entries = (const Hooks_Cached_Device *)(header + 1);
+    for (size_t i = 0; i < header->count; i++) {
+        const Hooks_Cached_Device *cached = &entries[i];
+        if (!cached_device_valid(cached) || cached_devices[cached->index] != NULL) continue;
+
+        // Indexes without an entry remain free, for devices that are not in the cache yet.
+        while (devices->count <= cached->index) {
+            devices->elems[devices->count] = (NB_Input_Device){ .fd = -1, .path = "", .name = "", .physical_path = "",
+                                                                .index = devices->count };
+            devices->count++;
+        }
+
+        NB_Input_Device *dev = &devices->elems[cached->index];
+        dev->type = cached->type;
+        dev->name = noh_arena_strdup(arena, cached->name);
+        dev->physical_path = noh_arena_strdup(arena, cached->phys);
+        cached_devices[cached->index] = cached;
+    }
+}
+
+// Writes the entries of all devices to the cache file if any of them changed, replacing the file at once.
+static void save_capability_cache(NB_Input_Devices *devices) {
+    if (!__atomic_exchange_n(&cache_dirty, false, __ATOMIC_RELAXED)) return;
+
+    char path[PATH_MAX], temp_path[PATH_MAX + 4];
+    if (!cache_file_path(path, sizeof(path))) return;
+    snprintf(temp_path, sizeof(temp_path), "%s.new", path);
+
+    // Create the directories of the cache file, only the last two are created if missing.
+    char *slash = strrchr(path, '/');
+    if (slash != NULL && hooks_config.cache_path == NULL) {
+        *slash = '\0';
+        char *parent = strrchr(path, '/');
+        if (parent != NULL) {
+            *parent = '\0';
+            mkdir(path, 0755);
+            *parent = '/';
+        }
+        mkdir(path, 0755);
+        *slash = '/';
+    }
+
+    FILE *file = fopen(temp_path, "wb");
+    if (file == NULL) {
+        noh_log(NOH_WARNING, "Could not write device cache %s: %s", temp_path, strerror(errno));
+        return;
+    }
+
+    Hooks_Cache_Header header = { .entry_size = sizeof(Hooks_Cached_Device) };
+    memcpy(header.magic, HOOKS_CACHE_MAGIC, sizeof(header.magic));
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+    int64 now = time(NULL);
+    for (size_t i = 0; i < devices->count && ok; i++) {
+        if (cached_devices[i] == NULL) continue;
+        if (devices->elems[i].fd < 0 && now - cached_devices[i]->last_seen > HOOKS_CACHE_EXPIRY) continue;
+
+        Hooks_Cached_Device cached = *cached_devices[i];
+        cached.index = i;
+        ok = fwrite(&cached, sizeof(cached), 1, file) == 1;
+        header.count++;
+    }
+
+    // Only now the number of entries is known.
+    ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+    if (fclose(file) != 0) ok = false;
+    if (!ok || rename(temp_path, path) < 0) {
+        noh_log(NOH_WARNING, "Could not write device cache %s: %s", path, strerror(errno));
+        unlink(temp_path);
+    }
+}
+
+// Saves the cache if needed, and frees all its entries.
+static void free_capability_cache(NB_Input_Devices *devices) {
+    save_capability_cache(devices);
+    memset(cached_devices, 0, sizeof(cached_devices));
+
+    for (size_t i = 0; i < cache_created.count; i++) free(cache_created.elems[i]);
+    noh_da_free(&cache_created);
+    cache_created.elems = NULL;
+
+    if (cache_map != NULL) munmap(cache_map, cache_map_size);
+    cache_map = NULL;
+    cache_map_size = 0;
+}
+
+// Checks the cached range of an absolute axis against what the device answered when querying its value, and queries
+// all capabilities of the device again if they differ. Queries that were answered from the cache before this may have
+// been outdated, those are corrected when the hooks are initialized again.
+static void validate_cached_axis(NB_Input_Device *dev, uint16 axis_id, const struct input_absinfo *abs_feat) {
+    const Hooks_Cached_Device *cached = cached_devices[dev->index];
+    const struct input_absinfo *cached_feat = &cached->abs_info[axis_id];
+    if (abs_feat != NULL && abs_feat->minimum == cached_feat->minimum && abs_feat->maximum == cached_feat->maximum &&
+        abs_feat->fuzz == cached_feat->fuzz && abs_feat->flat == cached_feat->flat &&
+        abs_feat->resolution == cached_feat->resolution) return;
+
+    noh_log(NOH_INFO, "Cached capabilities of device %s are outdated, querying them again.", dev->name);
+    cached_devices[dev->index] = cache_device(dev->fd, &cached->id, cached->name, cached->phys);
+}
+
+// Performs an ioctl on an evdev device. The capabilities of the device are answered from the cache.
+static int evdev_query(NB_Input_Device *dev, unsigned long request, void *arg) {
+    const Hooks_Cached_Device *cached = cached_devices[dev->index];
+    size_t size = _IOC_SIZE(request);
+    unsigned int nr = _IOC_NR(request);
+    bool read_request = _IOC_TYPE(request) == 'E' && _IOC_DIR(request) == _IOC_READ;
+
+    if (cached != NULL && read_request) {
+        if (nr == _IOC_NR(EVIOCGBIT(0, 0))) return copy_described(arg, size, cached->ev_bits, sizeof(cached->ev_bits));
+        if (nr == _IOC_NR(EVIOCGBIT(EV_KEY, 0))) return copy_described(arg, size, cached->key_bits, sizeof(cached->key_bits));
+        if (nr == _IOC_NR(EVIOCGBIT(EV_ABS, 0))) return copy_described(arg, size, cached->abs_bits, sizeof(cached->abs_bits));
+        if (nr == _IOC_NR(EVIOCGBIT(EV_REL, 0))) return copy_described(arg, size, cached->rel_bits, sizeof(cached->rel_bits));
+    }
+
+    int result = ioctl(dev->fd, request, arg);
+
+    // The values of absolute axes are always queried, which shows whether their cached ranges are still right.
+    if (cached != NULL && read_request && nr >= _IOC_NR(EVIOCGABS(0)) && nr < _IOC_NR(EVIOCGABS(ABS_CNT))) {
+        validate_cached_axis(dev, nr - _IOC_NR(EVIOCGABS(0)), result < 0 ? NULL : arg);
+    }
+
+    return result;
+}
+
+// Performs an evdev ioctl on a device, through the source of the device.
+static int device_ioctl(NB_Input_Device *dev, unsigned long request, void *arg) {
+    return hooks_source->query(dev, request, arg);
+}
+
+// Loads the bitmap of a type of capabilities of a device, 0 for the event types. Returns false if it failed.
+static bool load_bitmap(NB_Input_Device *dev, uint16 type, uint8 *bitmap, size_t size, const char *what) {
+    memset(bitmap, 0, size);
+    if (device_ioctl(dev, EVIOCGBIT(type, size), bitmap) < 0) {
+        noh_log(NOH_WARNING, "Could not determine %s of device %s.", what, dev->name);
+        return false;
+    }
+
+    return true;
+}
+
+// Loads the event types a device supports, into a bitmap of HOOKS_BITMAP_SIZE(EV_CNT) bytes.
+static bool load_capability_map(NB_Input_Device *dev, uint8 *capabilities) {
+    return load_bitmap(dev, 0, capabilities, HOOKS_BITMAP_SIZE(EV_CNT), "capabilities");
+}
+
+// Loads the absolute axes a device supports, into a bitmap of HOOKS_BITMAP_SIZE(ABS_CNT) bytes.
+static bool load_abs_map(NB_Input_Device *dev, uint8 *abs_map) {
+    return load_bitmap(dev, EV_ABS, abs_map, HOOKS_BITMAP_SIZE(ABS_CNT), "absolute map");
+}
+
+// Loads the relative axes a device supports, into a bitmap of HOOKS_BITMAP_SIZE(REL_CNT) bytes.
+static bool load_rel_map(NB_Input_Device *dev, uint8 *rel_map) {
+    return load_bitmap(dev, EV_REL, rel_map, HOOKS_BITMAP_SIZE(REL_CNT), "relative map");
+}
+
+// Loads the keys that are currently pressed on a device, into a bitmap of HOOKS_BITMAP_SIZE(KEY_CNT) bytes.
+static bool load_keymap(NB_Input_Device *dev, uint8 *keys) {
+    memset(keys, 0, HOOKS_BITMAP_SIZE(KEY_CNT));
+    if (device_ioctl(dev, EVIOCGKEY(HOOKS_BITMAP_SIZE(KEY_CNT)), keys) < 0) {
+        noh_log(NOH_WARNING, "Could not determine key map of device %s.", dev->name);
+        return false;
+    }
+
+    return true;
+}
+
+static int load_axis_info(NB_Input_Device *dev, size_t axis_id, struct input_absinfo *abs_feat) {
+    if (device_ioctl(dev, EVIOCGABS(axis_id), abs_feat)) {
+        noh_log(NOH_WARNING, "Unable to get info about axis %zu of device %s.", axis_id, dev->name);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Returns whether an absolute axis code is one of the multi-touch codes, which have a separate value for every slot.
+static bool is_mt_code(uint16 axis_id) {
+    return axis_id >= ABS_MT_SLOT && axis_id <= ABS_MT_TOOL_Y;
+}
+
+// Returns the number of slots of a multi-touch device that are tracked, and loads the information of the slot axis,
+// whose value is the current slot. Returns 0 if the slots could not be determined.
+static size_t touch_slot_count(NB_Input_Device *dev, struct input_absinfo *slot_info) {
+    if (load_axis_info(dev, ABS_MT_SLOT, slot_info) < 0 || slot_info->maximum < 0) return 0;
+
+    size_t slot_count = (size_t)slot_info->maximum + 1;
+    return slot_count < NBI_MAX_TOUCH_SLOTS ? slot_count : NBI_MAX_TOUCH_SLOTS;
+}
+
+// Loads the value of a multi-touch code for the specified number of slots.
+static bool load_touch_slots(NB_Input_Device *dev, uint16 code, int *values, size_t slot_count) {
+    noh_assert(slot_count <= NBI_MAX_TOUCH_SLOTS);
+
+    // The request starts with the code, the kernel fills in the values of the slots after it.
+    int32 request[NBI_MAX_TOUCH_SLOTS + 1] = { code };
+    if (device_ioctl(dev, EVIOCGMTSLOTS((slot_count + 1) * sizeof(int32)), request) < 0) {
+        noh_log(NOH_WARNING, "Unable to get the contacts of device %s.", dev->name);
+        return false;
+    }
+
+    memcpy(values, &request[1], slot_count * sizeof(int));
+    return true;
+}
+
+// The maximum number of threads that devices are probed on at once. Probing mostly waits for the devices to answer,
+// so this can be more than the number of cores.
+#define HOOKS_PROBE_THREADS 16
+
+// A task that run_parallel runs for every index below count.
+typedef struct {
+    void (*task)(void *context, size_t index);
+    void *context;
+    size_t count;
+    _Atomic size_t next; // The next index that a thread should run the task for.
+} Hooks_Parallel;
+
+// Keeps running the task for the next index, until all indexes were taken.
+static void *run_parallel_thread(void *arg) {
+    Hooks_Parallel *parallel = arg;
+
+    size_t index;
+    while ((index = atomic_fetch_add(&parallel->next, 1)) < parallel->count) {
+        parallel->task(parallel->context, index);
+    }
+
+    return NULL;
+}
+
+// Runs a task for every index below count, on up to HOOKS_PROBE_THREADS threads at once. Returns when all are done.
+static void run_parallel(size_t count, void (*task)(void *context, size_t index), void *context) {
+    Hooks_Parallel parallel = { .task = task, .context = context, .count = count, .next = 0 };
+
+    // The calling thread runs tasks as well, so a single device is probed without starting any thread.
+    pthread_t threads[HOOKS_PROBE_THREADS - 1];
+    size_t thread_count = 0;
+    while (thread_count + 1 < count && thread_count < noh_array_len(threads)) {
+        if (pthread_create(&threads[thread_count], NULL, run_parallel_thread, &parallel) != 0) break;
+        thread_count++;
+    }
+
+    run_parallel_thread(&parallel);
+    for (size_t i = 0; i < thread_count; i++) pthread_join(threads[i], NULL);
+}
+
+// Snaps a value of an absolute axis to the center if it is within the flat of the axis, and quantizes it if configured.
+static int snap_abs_value(const Input_Axis_Filter *filter, int value) {
+    int64 center = filter->minimum + ((int64)filter->maximum - filter->minimum) / 2;
+    int64 result = value;
+
+    // Deadzone around the center, so a stick at rest reports exactly its center.
+    if (filter->flat > 0 && llabs(result - center) <= filter->flat) return center;
+
+    int64 step = hooks_config.abs_quantization;
+    if (step > 1) {
+        // Round to the nearest step from the minimum.
+        int64 offset = result - filter->minimum;
+        offset = (offset >= 0 ? offset + step / 2 : offset - step / 2) / step * step;
+        result = filter->minimum + offset;
+    }
+
+    return result;
+}
+
+// Sets up the filter of an absolute axis from the axis information of the device. Returns the current value of the
+// axis as it is passed on.
+static int reset_abs_filter(Input_Axis_Filter *filter, const struct input_absinfo *abs_feat) {
+    filter->enabled = true;
+    filter->minimum = abs_feat->minimum;
+    filter->maximum = abs_feat->maximum;
+    filter->flat = abs_feat->flat;
+    filter->fuzz = abs_feat->fuzz;
+
+    filter->last_value = snap_abs_value(filter, abs_feat->value);
+    return filter->last_value;
+}
+
+// Applies the filter of an absolute axis to a new value of the axis. Returns false if the value should be dropped
+// because it did not change enough since the last value that was passed on.
+static bool filter_abs_value(Input_Axis_Filter *filter, int *value) {
+    if (!filter->enabled) return true;
+
+    int result = snap_abs_value(filter, *value);
+    if (result == filter->last_value) return false;
+
+    // Changes within the fuzz are noise, unless the axis settles at its center or one of its ends.
+    int center = filter->minimum + ((int64)filter->maximum - filter->minimum) / 2;
+    bool settled = result == center || result <= filter->minimum || result >= filter->maximum;
+    if (!settled && llabs((int64)result - filter->last_value) < filter->fuzz) return false;
+
+    filter->last_value = result;
+    *value = result;
+    return true;
+}
+
+// Converts a multi-touch event into a touch event for the event ring. Only the slot, tracking id and position of the
+// contacts are passed on. Returns false for other multi-touch codes.
+static bool stage_touch_event(const Input_Event *event, NBI_Input_Event *staged) {
+    switch (event->code) {
+        case ABS_MT_SLOT:
+            staged->type = NBI_Touch_Slot;
+            return true;
+        case ABS_MT_TRACKING_ID:
+            staged->type = NBI_Touch_Tracking_Id;
+            return true;
+        case ABS_MT_POSITION_X:
+            staged->type = NBI_Touch_X;
+            return true;
+        case ABS_MT_POSITION_Y:
+            staged->type = NBI_Touch_Y;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Converts a single event read from the device with the specified index into an event for the event ring.
+// Returns false if the event is not relevant for the input state.
+static bool stage_event(NB_Input_Devices *devices, size_t i, Input_Event *event, const struct timespec *time, NBI_Input_Event *staged) {
+    NB_Input_Device *dev = &devices->elems[i];
+    if (event_batches[i].monotonic_time) {
+        staged->time.tv_sec = event->time.tv_sec;
+        staged->time.tv_nsec = event->time.tv_usec * 1000;
+    } else {
+        staged->time = *time;
+    }
+    staged->device_index = dev->index;
+    staged->code = event->code;
+    staged->value = event->value;
+
+    switch(event->type) {
+        case EV_KEY:
+            // Only check up and down events.
+            if (event->value != 0 && event->value != 1) return false;
+
+            if (devices->default_kb_idx == -1 &&
+                event->code >= KEY_ESC && event->code <= KEY_COMPOSE) {
+                // Mark this device as default keyboard.
+                devices->default_kb_idx = i;
+            }
+
+            if (devices->default_mouse_idx == -1 &&
+                (event->code == BTN_LEFT || event->code == BTN_RIGHT || event->code == BTN_MIDDLE)) {
+                // Mark this device as default mouse.
+                devices->default_mouse_idx = i;
+            }
+
+            staged->type = event->value == 1 ? NBI_Key_Down : NBI_Key_Up;
+            return true;
+        case EV_ABS:
+            if (event->code >= ABS_CNT) return false;
+            if (event_batches[i].has_slots && is_mt_code(event->code)) return stage_touch_event(event, staged);
+            if (!filter_abs_value(&event_batches[i].abs_filters[event->code], &staged->value)) return false;
+
+            staged->type = NBI_Abs_Value;
+            return true;
+        case EV_REL:
+            if (devices->default_mouse_idx == -1) {
+                // Mark this device as default mouse.
+                devices->default_mouse_idx = i;
+            }
+
+            staged->type = NBI_Rel_Value;
+            return true;
+        case EV_SYN:
+            // The gestures on multi-touch devices are updated once per frame, when all contacts are up to date.
+            if (!event_batches[i].has_slots || event->code != SYN_REPORT) return false;
+
+            staged->type = NBI_Touch_Frame;
+            return true;
+        default:
+           return false;
+    }
+}
+
+// Sorts the events from the specified index onwards into frames. Complete frames are marked as committed, events of
+// frames that were interrupted by a SYN_DROPPED are removed from the batch.
+static void frame_batch(Input_Event_Batch *batch, size_t from) {
+    size_t write = from;
+    for (size_t read = from; read < batch->count; read++) {
+        Input_Event *event = &batch->elems[read];
+
+        if (batch->dropping) {
+            // Discard everything up to and including the next SYN_REPORT, after that the state can be reloaded.
+            if (event->type == EV_SYN && event->code == SYN_REPORT) {
+                batch->dropping = false;
+                batch->needs_resync = true;
+            }
+            continue;
+        }
+
+        if (event->type == EV_SYN && event->code == SYN_DROPPED) {
+            // The kernel buffer overflowed, discard the incomplete frame.
+            write = batch->committed;
+            batch->dropping = true;
+            continue;
+        }
+
+        batch->elems[write++] = *event;
+        if (event->type == EV_SYN && event->code == SYN_REPORT) batch->committed = write;
+    }
+
+    batch->count = write;
+}
+
+// Adds the events that were just read into the free space of the batch of the device at the specified index to the
+// batch, and sorts them into frames. Returns false if the read did not contain whole events.
+static bool append_batch(NB_Input_Devices *devices, size_t i, size_t bytes_read) {
+    Input_Event_Batch *batch = &event_batches[i];
+
+    if (bytes_read % sizeof(Input_Event) != 0) {
+        // The kernel only ever returns whole events, so this should not happen.
+        noh_log(NOH_ERROR, "Expected to read a multiple of %zu bytes, but got %zu", sizeof(Input_Event), bytes_read);
+        return false;
+    }
+
+    size_t from = batch->count;
+    batch->count += bytes_read / sizeof(Input_Event);
+    frame_batch(batch, from);
+
+    if (batch->count == HOOKS_EVENT_BATCH && batch->committed == 0) {
+        // A single frame does not fit in the batch, apply what we have rather than never applying anything.
+        noh_log(NOH_WARNING, "Frame of device %s does not fit in a batch of %d events.", devices->elems[i].name, HOOKS_EVENT_BATCH);
+        batch->committed = batch->count;
+    }
+
+    return true;
+}
+
+// Reads as many events as fit in the batch of the device at the specified index, until the device has no more events
+// available. Returns false if reading failed, in which case the batch may still contain events that were read before.
+static bool read_batch(NB_Input_Devices *devices, size_t i) {
+    Input_Event_Batch *batch = &event_batches[i];
+
+    while (batch->count < HOOKS_EVENT_BATCH) {
+        size_t space = (HOOKS_EVENT_BATCH - batch->count) * sizeof(Input_Event);
+        ssize_t bytes_read = read(devices->elems[i].fd, &batch->elems[batch->count], space);
+        if (bytes_read < 0) {
+            // The device is drained.
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+
+            noh_log(NOH_ERROR, "Failed reading from device %s: %s", devices->elems[i].name, strerror(errno));
+            return false;
+        }
+
+        if (!append_batch(devices, i, bytes_read)) return false;
+
+        // A short read means there is nothing left to read for now.
+        if ((size_t)bytes_read < space) return true;
+    }
+
+    // The batch is full, any remaining events will be read on the next wakeup.
+    return true;
+}
+
+// Removes the committed events from the batch once they are handled, moving the events of the incomplete frame to the
+// start of the batch.
+static void consume_batch(Input_Event_Batch *batch) {
+    batch->count -= batch->committed;
+    memmove(batch->elems, &batch->elems[batch->committed], batch->count * sizeof(Input_Event));
+    batch->committed = 0;
+}
+
+// Reloads the state of a device after events were dropped, by pushing its current keys and absolute axis values into
+// the event ring. Returns false if they did not fit, in which case it should be tried again later.
+static bool resync_device(Noh_Arena *arena, NB_Input_Device *dev, const struct timespec *time) {
+    noh_log(NOH_INFO, "Events of device %s were dropped, reloading its state.", dev->name);
+    noh_arena_save(arena);
+
+    // Room for every key and axis, and for selecting every slot and setting its contact, plus restoring the slot.
+    size_t capacity = KEY_MAX + ABS_MAX + 1 + NBI_MAX_TOUCH_SLOTS * 4 + 1;
+    NBI_Input_Event *events = noh_arena_alloc(arena, capacity * sizeof(NBI_Input_Event));
+    size_t count = 0;
+    NBI_Input_Event event = { .time = *time, .device_index = dev->index };
+
+    // Reload the pressed keys.
+    uint8 pressed[HOOKS_BITMAP_SIZE(KEY_CNT)];
+    if (load_keymap(dev, pressed)) {
+        event.type = NBI_Clear_Keys;
+        events[count++] = event;
+
+        event.type = NBI_Key_Down;
+        for_each_set_bit(key, pressed, 1, KEY_MAX) {
+            event.code = key;
+            events[count++] = event;
+        }
+    }
+
+    // Reload the absolute axis values.
+    uint8 abs_map[HOOKS_BITMAP_SIZE(ABS_CNT)];
+    if (load_abs_map(dev, abs_map)) {
+        event.type = NBI_Abs_Value;
+        for_each_set_bit(axis_id, abs_map, 0, ABS_MAX) {
+            struct input_absinfo abs_feat;
+            if (event_batches[dev->index].has_slots && is_mt_code(axis_id)) continue;
+            if (load_axis_info(dev, axis_id, &abs_feat) < 0) continue;
+
+            event.code = axis_id;
+            event.value = reset_abs_filter(&event_batches[dev->index].abs_filters[axis_id], &abs_feat);
+            events[count++] = event;
+        }
+    }
+
+    // Reload the touch contacts, slot by slot.
+    struct input_absinfo slot_info;
+    size_t slot_count = event_batches[dev->index].has_slots ? touch_slot_count(dev, &slot_info) : 0;
+    int tracking_ids[NBI_MAX_TOUCH_SLOTS], x[NBI_MAX_TOUCH_SLOTS], y[NBI_MAX_TOUCH_SLOTS];
+    if (slot_count > 0 &&
+        load_touch_slots(dev, ABS_MT_TRACKING_ID, tracking_ids, slot_count) &&
+        load_touch_slots(dev, ABS_MT_POSITION_X, x, slot_count) &&
+        load_touch_slots(dev, ABS_MT_POSITION_Y, y, slot_count)) {
+        event.code = 0;
+        for (size_t slot = 0; slot < slot_count; slot++) {
+            event.type = NBI_Touch_Slot;
+            event.value = slot;
+            events[count++] = event;
+
+            event.type = NBI_Touch_Tracking_Id;
+            event.value = tracking_ids[slot];
+            events[count++] = event;
+
+            event.type = NBI_Touch_X;
+            event.value = x[slot];
+            events[count++] = event;
+
+            event.type = NBI_Touch_Y;
+            event.value = y[slot];
+            events[count++] = event;
+        }
+
+        event.type = NBI_Touch_Slot;
+        event.value = slot_info.value;
+        events[count++] = event;
+
+        event.type = NBI_Touch_Frame;
+        event.value = 0;
+        events[count++] = event;
+    }
+
+    bool result = hooks_ring_push(&event_ring, events, count);
+    noh_arena_rewind(arena);
+    return result;
+}
+
+///////////////////////// Recording /////////////////////////
+
+// A recording starts with this magic, followed by records. Every record is a Hooks_Record, records of type
+// HOOKS_RECORD_DEVICE are followed by a Hooks_Device_Description. The devices that are known when recording starts are
+// described first, devices that are added later are described when they are added.
+#define HOOKS_RECORD_MAGIC "NBREC001"
+
+// A record type for the description of a device that was added, the value of the record is unused.
+#define HOOKS_RECORD_DEVICE 0xffff
+
+// A record type for a device that was removed, the value of the record is unused.
+#define HOOKS_RECORD_REMOVED 0xfffe
+
+// A single record in a recording. Other than the records for added and removed devices, this is an input event as it
+// was read from the device, before it was filtered.
+typedef struct {
+    int64 time; // The monotonic time in nanoseconds at which the event happened.
+    uint32 device_index;
+    uint16 type; // The evdev event type, or one of the HOOKS_RECORD_ types.
+    uint16 code;
+    int32 value;
+    uint32 reserved; // Keeps records 8 byte aligned, always 0.
+} Hooks_Record;
+
+// The recording that the run thread writes all events into, or NULL if not recording. Buffered, since the run thread
+// should not wait for the disk.
+static FILE *record_file = NULL;
+
+// The size of the buffer of the recording.
+#define HOOKS_RECORD_BUFFER (64 KB)
+
+// Writes records to the recording, stops recording if that fails.
+static void write_records(const Hooks_Record *records, size_t count) {
+    if (fwrite(records, sizeof(Hooks_Record), count, record_file) != count) {
+        noh_log(NOH_ERROR, "Failed writing to the recording, stopping it: %s", strerror(errno));
+        fclose(record_file);
+        record_file = NULL;
+    }
+}
+
+// Writes the description of a device to the recording.
+static void record_device(NB_Input_Device *dev) {
+    if (record_file == NULL) return;
+
+    Hooks_Device_Description *recorded = calloc(1, sizeof(Hooks_Device_Description));
+    noh_assert(recorded != NULL && "Could not allocate enough memory");
+
+    strncpy(recorded->name, dev->name, sizeof(recorded->name) - 1);
+    strncpy(recorded->phys, dev->physical_path, sizeof(recorded->phys) - 1);
+    strncpy(recorded->path, dev->path, sizeof(recorded->path) - 1);
+
+    // Whatever cannot be queried stays empty, the device is then replayed without it.
+    device_ioctl(dev, EVIOCGBIT(0, sizeof(recorded->ev_bits)), recorded->ev_bits);
+    device_ioctl(dev, EVIOCGBIT(EV_KEY, sizeof(recorded->key_bits)), recorded->key_bits);
+    device_ioctl(dev, EVIOCGBIT(EV_ABS, sizeof(recorded->abs_bits)), recorded->abs_bits);
+    device_ioctl(dev, EVIOCGBIT(EV_REL, sizeof(recorded->rel_bits)), recorded->rel_bits);
+    device_ioctl(dev, EVIOCGKEY(sizeof(recorded->pressed)), recorded->pressed);
+
+    for_each_set_bit(axis_id, recorded->abs_bits, 0, ABS_CNT) {
+        device_ioctl(dev, EVIOCGABS(axis_id), &recorded->abs_info[axis_id]);
+    }
+
+    struct input_absinfo slot_info;
+    size_t slot_count = test_bit(recorded->abs_bits, sizeof(recorded->abs_bits), ABS_MT_SLOT)
+        ? touch_slot_count(dev, &slot_info) : 0;
+    if (slot_count > 0) {
+        load_touch_slots(dev, ABS_MT_TRACKING_ID, recorded->slots[0], slot_count);
+        load_touch_slots(dev, ABS_MT_POSITION_X, recorded->slots[1], slot_count);
+        load_touch_slots(dev, ABS_MT_POSITION_Y, recorded->slots[2], slot_count);
+    }
+
+    Hooks_Record record = { .time = noh_get_monotonic_ns(), .device_index = dev->index, .type = HOOKS_RECORD_DEVICE };
+    write_records(&record, 1);
+    if (record_file != NULL && fwrite(recorded, sizeof(Hooks_Device_Description), 1, record_file) != 1) {
+        noh_log(NOH_ERROR, "Failed writing to the recording, stopping it: %s", strerror(errno));
+        fclose(record_file);
+        record_file = NULL;
+    }
+
+    free(recorded);
+}
+
+// Writes to the recording that a device was removed.
+static void record_removed(NB_Input_Device *dev) {
+    if (record_file == NULL) return;
+
+    Hooks_Record record = { .time = noh_get_monotonic_ns(), .device_index = dev->index, .type = HOOKS_RECORD_REMOVED };
+    write_records(&record, 1);
+}
+
+// Writes the complete frames in the batch of a device to the recording. Events are timestamped like stage_event does.
+static void record_batch(NB_Input_Device *dev, const struct timespec *time) {
+    if (record_file == NULL) return;
+
+    Input_Event_Batch *batch = &event_batches[dev->index];
+    Hooks_Record records[HOOKS_EVENT_BATCH];
+    for (size_t i = 0; i < batch->committed; i++) {
+        Input_Event *event = &batch->elems[i];
+        int64 event_time = batch->monotonic_time
+            ? (int64)event->time.tv_sec * 1000 * 1000 * 1000 + (int64)event->time.tv_usec * 1000
+            : (int64)time->tv_sec * 1000 * 1000 * 1000 + time->tv_nsec;
+
+        records[i] = (Hooks_Record){
+            .time = event_time,
+            .device_index = dev->index,
+            .type = event->type,
+            .code = event->code,
+            .value = event->value
+        };
+    }
+
+    if (batch->committed > 0) write_records(records, batch->committed);
+}
+
+// Starts recording to the specified file, describing all currently known devices.
+static bool start_recording(NB_Input_Devices *devices, const char *path) {
+    record_file = fopen(path, "wb");
+    if (record_file == NULL) {
+        noh_log(NOH_ERROR, "Could not open recording %s: %s", path, strerror(errno));
+        return false;
+    }
+    setvbuf(record_file, NULL, _IOFBF, HOOKS_RECORD_BUFFER);
+
+    if (fwrite(HOOKS_RECORD_MAGIC, strlen(HOOKS_RECORD_MAGIC), 1, record_file) != 1) {
+        noh_log(NOH_ERROR, "Failed writing to recording %s: %s", path, strerror(errno));
+        fclose(record_file);
+        record_file = NULL;
+        return false;
+    }
+
+    for (size_t i = 0; i < devices->count; i++) {
+        if (devices->elems[i].fd >= 0) record_device(&devices->elems[i]);
+    }
+
+    noh_log(NOH_INFO, "Recording input to %s.", path);
+    return true;
+}
+
+// Writes what is left in the buffer of the recording and closes it.
+static void stop_recording() {
+    if (record_file == NULL) return;
+
+    if (fclose(record_file) != 0) noh_log(NOH_ERROR, "Failed writing the recording: %s", strerror(errno));
+    record_file = NULL;
+}
+
+///////////////////////// io_uring /////////////////////////
+
+// The io_uring backend keeps a read in flight on every device, directly into the free space of its batch. The kernel
+// completes a read as soon as the device has events, and the run thread re-arms all completed reads and waits for the
+// next completions with a single io_uring_enter, instead of an epoll_wait plus at least two reads per ready device.
+
+// The number of submission queue entries. Every device has at most one read and one cancellation in flight, on top of
+// the polls for the wake_fd and inotify_fd.
+#define HOOKS_URING_ENTRIES 512
+
+// The user data of the polls for the wake_fd and inotify_fd. Reads use the device index in the lower 32 bits, and the
+// generation of the device in the upper 32 bits, so completions of reads on a closed file descriptor are recognized.
+#define HOOKS_URING_WAKE UINT64_MAX
+#define HOOKS_URING_INOTIFY (UINT64_MAX - 1)
+#define HOOKS_URING_IGNORE (UINT64_MAX - 2) // Completions that need no handling, like cancellations.
+
+// A submission and completion queue pair, shared with the kernel.
+typedef struct {
+    int fd;
+
+    uint32 *sq_head;
+    uint32 *sq_tail;
+    uint32 sq_mask;
+    uint32 *sq_array;
+    struct io_uring_sqe *sqes;
+    uint32 sq_entries;
+    uint32 to_submit; // The number of entries queued since the last io_uring_enter.
+
+    uint32 *cq_head;
+    uint32 *cq_tail;
+    uint32 cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *rings;
+    size_t rings_size;
+    size_t sqes_size;
+
+    // Whether event_batches is registered with the kernel, so reads into it do not need to map the pages every time.
+    bool fixed_buffers;
+} Hooks_Uring;
+
+static Hooks_Uring uring = { .fd = -1 };
+
+// The generation of every device, increased whenever the device is watched or closed.
+static uint32 uring_generations[NBI_MAX_DEVICES];
+
+// Calls io_uring_enter to submit all queued entries, and waits for at least the specified number of completions.
+// Returns false if this failed for any other reason than an interrupt.
+static bool uring_enter(Hooks_Uring *ring, uint32 min_complete) {
+    uint32 flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, min_complete, flags, NULL, 0);
+    if (submitted < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY) return true; // Try again on the next call.
+
+        noh_log(NOH_ERROR, "Failed to submit to io_uring: %s", strerror(errno));
+        return false;
+    }
+
+    ring->to_submit -= submitted;
+    return true;
+}
+
+// Queues an entry in the submission queue, it is submitted with the next call to uring_enter.
+static void uring_queue(Hooks_Uring *ring, const struct io_uring_sqe *sqe) {
+    uint32 tail = *ring->sq_tail;
+    while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        // The queue is full, submit what we have to make room.
+        if (!uring_enter(ring, 0)) return;
+    }
+
+    uint32 index = tail & ring->sq_mask;
+    ring->sqes[index] = *sqe;
+    ring->sq_array[index] = index;
+
+    // Make the entry visible to the kernel.
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
+
+// Queues a poll for input on a file descriptor, which is not a device.
+static void uring_queue_poll(Hooks_Uring *ring, int fd, uint64 user_data) {
+    struct io_uring_sqe sqe = {0};
+    sqe.opcode = IORING_OP_POLL_ADD;
+    sqe.fd = fd;
+    sqe.poll32_events = POLLIN;
+    sqe.user_data = user_data;
+    uring_queue(ring, &sqe);
+}
+
+// Queues a read of as many events as fit in the batch of a device.
+static void uring_queue_read(Hooks_Uring *ring, NB_Input_Device *dev) {
+    Input_Event_Batch *batch = &event_batches[dev->index];
+
+    struct io_uring_sqe sqe = {0};
+    sqe.opcode = ring->fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe.fd = dev->fd;
+    sqe.addr = (uint64)(uintptr_t)&batch->elems[batch->count];
+    sqe.len = (HOOKS_EVENT_BATCH - batch->count) * sizeof(Input_Event);
+    sqe.off = (uint64)-1; // Devices have no position, read from wherever they are.
+    sqe.buf_index = 0;
+    sqe.user_data = (uint64)uring_generations[dev->index] << 32 | dev->index;
+    uring_queue(ring, &sqe);
+}
+
+// Cancels the read in flight on a device that is being closed. Its completion is ignored through the generation.
+static void uring_cancel_read(Hooks_Uring *ring, NB_Input_Device *dev) {
+    struct io_uring_sqe sqe = {0};
+    sqe.opcode = IORING_OP_ASYNC_CANCEL;
+    sqe.addr = (uint64)uring_generations[dev->index] << 32 | dev->index;
+    sqe.user_data = HOOKS_URING_IGNORE;
+    uring_queue(ring, &sqe);
+
+    uring_generations[dev->index]++;
+}
+
+// Sets up an io_uring instance and maps its queues. Returns false if io_uring is not available.
+static bool uring_setup(Hooks_Uring *ring) {
+    struct io_uring_params params = {0};
+    int fd = syscall(__NR_io_uring_setup, HOOKS_URING_ENTRIES, &params);
+    if (fd < 0) {
+        noh_log(NOH_INFO, "io_uring is not available: %s", strerror(errno));
+        return false;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        noh_log(NOH_INFO, "io_uring is too old to be used.");
+        close(fd);
+        return false;
+    }
+
+    // Both queues are in a single mapping, which needs to be large enough for the largest one.
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t rings_size = sq_size > cq_size ? sq_size : cq_size;
+    char *rings = mmap(NULL, rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED) {
+        noh_log(NOH_WARNING, "Could not map io_uring queues: %s", strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    size_t sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        noh_log(NOH_WARNING, "Could not map io_uring submission entries: %s", strerror(errno));
+        munmap(rings, rings_size);
+        close(fd);
+        return false;
+    }
+
+    ring->fd = fd;
+    ring->sq_head = (uint32 *)(rings + params.sq_off.head);
+    ring->sq_tail = (uint32 *)(rings + params.sq_off.tail);
+    ring->sq_mask = *(uint32 *)(rings + params.sq_off.ring_mask);
+    ring->sq_array = (uint32 *)(rings + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sqes = sqes;
+    ring->to_submit = 0;
+    ring->cq_head = (uint32 *)(rings + params.cq_off.head);
+    ring->cq_tail = (uint32 *)(rings + params.cq_off.tail);
+    ring->cq_mask = *(uint32 *)(rings + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+    ring->rings = rings;
+    ring->rings_size = rings_size;
+    ring->sqes_size = sqes_size;
+
+    // Register all batches as a single buffer. This pins the memory, which can fail if the memory lock limit is low, in
+    // that case plain reads are used.
+    struct iovec buffer = { .iov_base = event_batches, .iov_len = NBI_MAX_DEVICES * sizeof(Input_Event_Batch) };
+    ring->fixed_buffers = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, &buffer, 1) == 0;
+    if (!ring->fixed_buffers) {
+        noh_log(NOH_INFO, "Could not register io_uring buffers, using plain reads: %s", strerror(errno));
+    }
+
+    return true;
+}
+
+// Unmaps the queues and closes the io_uring instance, which cancels everything that is still in flight.
+static void uring_free(Hooks_Uring *ring) {
+    if (ring->fd < 0) return;
+
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->rings, ring->rings_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+// Increased for a device whenever its file descriptor changes. The state thread queries devices that the run thread
+// may close at any moment, after which the number of the file descriptor can be reused for another device. Comparing
+// the generation before and after a query tells whether it was still asking the same open device.
+static _Atomic uint32 fd_generations[NBI_MAX_DEVICES];
+
+// Changes the file descriptor of a known device. Only the run thread does this, while other threads may read it.
+static void set_device_fd(NB_Input_Device *dev, int fd) {
+    atomic_fetch_add(&fd_generations[dev->index], 1);
+    __atomic_store_n(&dev->fd, fd, __ATOMIC_SEQ_CST);
+}
+
+// Gets the keys that a device reports as pressed, from a thread other than the run thread. Returns 1 if they were
+// read, 0 if the device is closed, 2 if it was closed or reopened while asking it, and -1 if asking it failed.
+static int query_pressed_keys(NB_Input_Device *dev, uint64 *keys, size_t size) {
+    uint32 generation = atomic_load(&fd_generations[dev->index]);
+    NB_Input_Device device = {
+        .type = dev->type,
+        .index = dev->index,
+        .fd = __atomic_load_n(&dev->fd, __ATOMIC_SEQ_CST),
+        .path = dev->path,
+        .name = dev->name,
+        .physical_path = dev->physical_path
+    };
+    if (device.fd < 0) return 0;
+
+    int result = device_ioctl(&device, EVIOCGKEY(size), keys);
+    if (atomic_load(&fd_generations[dev->index]) != generation) return 2;
+    return result < 0 ? -1 : 1;
+}
+
+// Stops watching the specified device and closes its file descriptor, and releases all its keys.
+// The device will still be listed so the indexes of devices remain stable, but no input will come from it anymore.
+// If the same device is added again later, it will get its old index back.
+static void close_device(NB_Input_Device *dev) {
+    noh_log(NOH_INFO, "Closing device %s.", dev->name);
+    if (hooks_backend == NB_Backend_Io_Uring) uring_cancel_read(&uring, dev);
+    else epoll_ctl(epoll_fd, EPOLL_CTL_DEL, dev->fd, NULL);
+
+    int fd = dev->fd;
+    set_device_fd(dev, -1);
+    close(fd);
+    record_removed(dev);
+
+    // If this does not fit, the state thread will clean up the keys of the closed device later.
+    NBI_Input_Event event = { .time = noh_get_monotonic_time(), .device_index = dev->index, .type = NBI_Clear_Keys };
+    if (hooks_ring_push(&event_ring, &event, 1)) wake_state();
+}
+
+// Closes the file descriptors of all devices that are still open, when the hooks stop.
+static void close_devices(NB_Input_Devices *devices) {
+    for (size_t i = 0; i < devices->count; i++) {
+        NB_Input_Device *dev = &devices->elems[i];
+        if (dev->fd < 0) continue; // Already closed.
+
+        int fd = dev->fd;
+        set_device_fd(dev, -1);
+        if (close(fd) != 0) {
+            noh_log(NOH_WARNING, "Failed closing input device %s: %s", dev->name, strerror(errno));
+        }
+    }
+}
+
+static int open_device(Noh_Arena *arena, NB_Input_Devices *devices, const char *device_path);
+static void probe_device(NBI_Input_State *state, NB_Input_Device *dev);
+
+// Has the kernel only pass the types of events that stage_event handles, and that the device can actually send. Other
+// events, like the EV_MSC scan codes that keyboards send with every key, are then dropped before they are queued, and
+// frames that contain only such events no longer wake up the run thread at all.
+static void mask_device(NB_Input_Device *dev) {
+    uint8 capabilities[EV_CNT / 8 + 1] = {0};
+    if (device_ioctl(dev, EVIOCGBIT(0, sizeof(capabilities)), capabilities) < 0) {
+        noh_log(NOH_WARNING, "Could not determine capabilities of device %s.", dev->name);
+        return;
+    }
+
+    // The mask for type EV_SYN is the mask of event types. SYN_DROPPED is never masked by the kernel.
+    uint8 types[EV_CNT / 8 + 1] = {0};
+    uint16 handled_types[] = { EV_SYN, EV_KEY, EV_ABS, EV_REL };
+    for (size_t i = 0; i < noh_array_len(handled_types); i++) {
+        uint16 type = handled_types[i];
+        if (type == EV_SYN || test_bit(capabilities, sizeof(capabilities), type)) types[type / 8] |= 1 << (type % 8);
+    }
+
+    struct input_mask mask = { .type = EV_SYN, .codes_size = sizeof(types), .codes_ptr = (uint64)(uintptr_t)types };
+    if (device_ioctl(dev, EVIOCSMASK, &mask) < 0) {
+        // Older kernels don't support masks, the events are then discarded by stage_event instead.
+        noh_log(NOH_INFO, "Could not mask events of device %s: %s", dev->name, strerror(errno));
+        return;
+    }
+
+    // Of multi-touch devices only the slot, tracking id and position of the contacts are used, so pressure, contact
+    // size and the like don't need to be passed either.
+    uint8 abs_map[ABS_CNT / 8] = {0};
+    if (device_ioctl(dev, EVIOCGBIT(EV_ABS, sizeof(abs_map)), abs_map) < 0) return;
+    if (!test_bit(abs_map, sizeof(abs_map), ABS_MT_SLOT)) return;
+
+    for (uint16 axis_id = ABS_MT_SLOT; axis_id <= ABS_MT_TOOL_Y; axis_id++) {
+        if (axis_id == ABS_MT_SLOT || axis_id == ABS_MT_TRACKING_ID) continue;
+        if (axis_id == ABS_MT_POSITION_X || axis_id == ABS_MT_POSITION_Y) continue;
+        abs_map[axis_id / 8] &= ~(1 << (axis_id % 8));
+    }
+
+    mask = (struct input_mask){ .type = EV_ABS, .codes_size = sizeof(abs_map), .codes_ptr = (uint64)(uintptr_t)abs_map };
+    if (device_ioctl(dev, EVIOCSMASK, &mask) < 0) {
+        noh_log(NOH_INFO, "Could not mask multi-touch events of device %s: %s", dev->name, strerror(errno));
+    }
+}
+
+// Sets up the filters of all absolute axes of a device, from its current axis information.
+static void load_abs_filters(NB_Input_Device *dev) {
+    Input_Event_Batch *batch = &event_batches[dev->index];
+
+    uint8 abs_map[ABS_CNT / 8] = {0};
+    if (device_ioctl(dev, EVIOCGBIT(EV_ABS, sizeof(abs_map)), abs_map) < 0) return; // No absolute axes.
+    batch->has_slots = test_bit(abs_map, sizeof(abs_map), ABS_MT_SLOT);
+
+    for_each_set_bit(axis_id, abs_map, 0, ABS_MAX) {
+        struct input_absinfo abs_feat;
+        if (batch->has_slots && is_mt_code(axis_id)) continue; // Every slot has its own value, these are not filtered.
+        if (load_axis_info(dev, axis_id, &abs_feat) < 0) continue;
+
+        reset_abs_filter(&batch->abs_filters[axis_id], &abs_feat);
+    }
+}
+
+// Prepares a device to be watched, from a clean batch. Only touches the batch of the device, so devices can be
+// prepared at the same time.
+static void prepare_device(NB_Input_Device *dev) {
+    Input_Event_Batch *batch = &event_batches[dev->index];
+    memset(batch, 0, sizeof(Input_Event_Batch));
+
+    // Have the kernel timestamp events with the monotonic clock, so they can be used as is.
+    int clock_id = CLOCK_MONOTONIC;
+    if (device_ioctl(dev, EVIOCSCLOCKID, &clock_id) < 0) {
+        noh_log(NOH_WARNING, "Could not use monotonic timestamps for device %s: %s", dev->name, strerror(errno));
+    } else {
+        batch->monotonic_time = true;
+    }
+
+    mask_device(dev);
+    load_abs_filters(dev);
+}
+
+// Prepares one of the devices that the run thread starts out with.
+static void prepare_device_task(void *context, size_t index) {
+    NB_Input_Devices *devices = context;
+    if (devices->elems[index].fd >= 0) prepare_device(&devices->elems[index]);
+}
+
+// Starts watching a device that was prepared.
+static void watch_device(NB_Input_Device *dev) {
+    if (hooks_backend == NB_Backend_Io_Uring) {
+        // io_uring completes reads on non-blocking files right away when there is nothing to read, instead of waiting
+        // for input.
+        int flags = fcntl(dev->fd, F_GETFL);
+        if (flags < 0 || fcntl(dev->fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+            noh_log(NOH_WARNING, "Could not watch device %s: %s", dev->name, strerror(errno));
+            return;
+        }
+
+        uring_generations[dev->index]++;
+        uring_queue_read(&uring, dev);
+        return;
+    }
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = dev };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, dev->fd, &event) < 0) {
+        noh_log(NOH_WARNING, "Could not watch device %s: %s", dev->name, strerror(errno));
+    }
+}
+
+// Lets the state thread know about an added device, returns false if there was no room in the event ring.
+static bool announce_device(NB_Input_Device *dev) {
+    NBI_Input_Event event = { .time = noh_get_monotonic_time(), .device_index = dev->index, .type = NBI_Device_Added };
+    return hooks_ring_push(&event_ring, &event, 1);
+}
+
+// Opens and starts watching a device that appeared while running. Its initial state is probed here and handed over
+// to the state thread.
+static void add_device(Noh_Arena *arena, NB_Input_Devices *devices, const char *device_path) {
+    // Check if the device is already open, we can get multiple notifications for the same device.
+    for (size_t i = 0; i < devices->count; i++) {
+        NB_Input_Device *dev = &devices->elems[i];
+        if (dev->fd >= 0 && strcmp(dev->path, device_path) == 0) return;
+    }
+
+    int index = open_device(arena, devices, device_path);
+    if (index < 0) return;
+
+    NB_Input_Device *dev = &devices->elems[index];
+    noh_log(NOH_INFO, "Adding device %s.", dev->name);
+
+    NBI_Input_State *device_state = noh_realloc_check(NULL, sizeof(NBI_Input_State));
+    memset(device_state, 0, sizeof(NBI_Input_State));
+    probe_device(device_state, dev);
+    hooks_offer_device_state(dev->index, device_state);
+
+    prepare_device(dev);
+    watch_device(dev);
+    record_device(dev);
+    if (announce_device(dev)) wake_state();
+    else event_batches[dev->index].needs_announce = true;
+}
+
+// Handles the notifications about devices being added or removed from the input directory.
+static void handle_inotify(Noh_Arena *arena, NB_Input_Devices *devices) {
+    // Buffer aligned as required for inotify events.
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    while (true) {
+        ssize_t len = read(inotify_fd, buffer, sizeof(buffer));
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                noh_log(NOH_WARNING, "Failed reading device notifications: %s", strerror(errno));
+            }
+            return;
+        }
+
+        const struct inotify_event *event;
+        for (char *ptr = buffer; ptr < buffer + len; ptr += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *) ptr;
+            if (event->len == 0) continue;
+            if (!noh_sv_starts_with(noh_sv_from_cstr(event->name), noh_sv_from_cstr("event"))) continue;
+
+            noh_arena_save(arena);
+            char *device_path = noh_arena_sprintf(arena, "%s/%s", INPUT_BASE_PATH, event->name);
+
+            if (event->mask & IN_DELETE) {
+                for (size_t i = 0; i < devices->count; i++) {
+                    NB_Input_Device *dev = &devices->elems[i];
+                    if (dev->fd >= 0 && strcmp(dev->path, device_path) == 0) close_device(dev);
+                }
+            } else {
+                // Created, or its permissions changed so we may now be able to open it.
+                add_device(&hooks_arena, devices, device_path);
+            }
+
+            noh_arena_rewind(arena);
+        }
+    }
+}
+
+///////////////////////// Scheduling /////////////////////////
+
+// The resolution of the histogram of read delays, in nanoseconds.
+#define HOOKS_JITTER_STEP (10 * 1000)
+
+// The number of buckets of the histogram of read delays, the last one also counts all longer delays.
+#define HOOKS_JITTER_BUCKETS 1000
+
+// How long after the kernel timestamped the last event of a frame the run thread handled it. Only written by the run
+// thread, and only accessed atomically.
+typedef struct {
+    size_t buckets[HOOKS_JITTER_BUCKETS];
+    size_t count;
+    int64 max;
+} Hooks_Jitter;
+
+static Hooks_Jitter jitter = {0};
+
+// Records how long after the kernel received it the last event of a batch was handled.
+static void record_read_delay(Input_Event_Batch *batch, const struct timespec *time) {
+    if (!batch->monotonic_time || batch->committed == 0) return;
+
+    const Input_Event *event = &batch->elems[batch->committed - 1];
+    int64 delay = ((int64)time->tv_sec - event->time.tv_sec) * 1000 * 1000 * 1000 +
+                  (int64)time->tv_nsec - (int64)event->time.tv_usec * 1000;
+    if (delay < 0) delay = 0;
+
+    size_t bucket = delay / HOOKS_JITTER_STEP;
+    if (bucket >= HOOKS_JITTER_BUCKETS) bucket = HOOKS_JITTER_BUCKETS - 1;
+    __atomic_fetch_add(&jitter.buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&jitter.count, 1, __ATOMIC_RELAXED);
+    if (delay > __atomic_load_n(&jitter.max, __ATOMIC_RELAXED)) __atomic_store_n(&jitter.max, delay, __ATOMIC_RELAXED);
+}
+
+// Returns the delay in microseconds below which the specified fraction of the reads was handled.
+static double jitter_percentile(size_t count, double fraction) {
+    size_t seen = 0;
+    for (size_t i = 0; i < HOOKS_JITTER_BUCKETS; i++) {
+        seen += __atomic_load_n(&jitter.buckets[i], __ATOMIC_RELAXED);
+        if (seen >= count * fraction) return (double)(i + 1) * HOOKS_JITTER_STEP / 1000;
+    }
+
+    return (double)HOOKS_JITTER_BUCKETS * HOOKS_JITTER_STEP / 1000;
+}
+
+NB_Hooks_Jitter hooks_get_jitter() {
+    NB_Hooks_Jitter result = { .count = __atomic_load_n(&jitter.count, __ATOMIC_RELAXED) };
+    if (result.count == 0) return result;
+
+    result.p50 = jitter_percentile(result.count, 0.5);
+    result.p99 = jitter_percentile(result.count, 0.99);
+    result.max = (double)__atomic_load_n(&jitter.max, __ATOMIC_RELAXED) / 1000;
+    return result;
+}
+
+// Applies the scheduling policy and CPUs from the configuration to the calling thread. Whatever is not permitted is
+// left as it was, the thread works the same only with less predictable timing.
+static void configure_thread(const char *name, NB_Hooks_Scheduling scheduling, int priority, uint64 cpus) {
+    if (scheduling != NB_Scheduling_Default) {
+        int policy = scheduling == NB_Scheduling_Fifo ? SCHED_FIFO : SCHED_RR;
+        struct sched_param param = { .sched_priority = priority > 0 ? priority : sched_get_priority_min(policy) };
+        int result = pthread_setschedparam(pthread_self(), policy, &param);
+        if (result != 0) {
+            noh_log(NOH_WARNING, "Could not use real-time scheduling for the %s thread: %s", name, strerror(result));
+        }
+    }
+
+    if (cpus != 0) {
+        // The kernel takes the mask as an array of longs.
+        const size_t long_bits = 8 * sizeof(unsigned long);
+        unsigned long mask[64 / (8 * sizeof(unsigned long))] = {0};
+        for (size_t cpu = 0; cpu < 64; cpu++) {
+            if (cpus & ((uint64)1 << cpu)) mask[cpu / long_bits] |= 1UL << (cpu % long_bits);
+        }
+
+        if (syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) < 0) {
+            noh_log(NOH_WARNING, "Could not pin the %s thread to CPUs 0x%llx: %s", name, (unsigned long long)cpus,
+                    strerror(errno));
+        }
+    }
+}
+
+// Whether the memory of the process was locked by the hooks.
+static bool memory_locked = false;
+
+// Locks the memory of the process as it is used, if configured. Memory that was reserved but never touched, like most
+// of the snapshot buffers, is not locked.
+static void lock_memory() {
+    if (!hooks_config.lock_memory || memory_locked) return;
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) < 0) {
+        noh_log(NOH_WARNING, "Could not lock memory: %s", strerror(errno));
+        return;
+    }
+
+    memory_locked = true;
+}
+
+// Unlocks the memory of the process, if it was locked.
+static void unlock_memory() {
+    if (!memory_locked) return;
+
+    munlockall();
+    memory_locked = false;
+}
+
+// Pushes all complete frames that were read from a device into the event ring, in a single push so the consumer never
+// sees half a frame, and reloads the state of the device if events were lost. The staged events must have room for a
+// full batch. Returns true if anything was pushed.
+static bool flush_batch(Noh_Arena *arena, NB_Input_Devices *devices, NB_Input_Device *dev, const struct timespec *time,
+                        NBI_Input_Event *staged) {
+    Input_Event_Batch *batch = &event_batches[dev->index];
+    bool pushed = false;
+
+    if (batch->needs_announce) {
+        // The state thread must know the device before it can handle its events.
+        if (!announce_device(dev)) return false;
+        batch->needs_announce = false;
+        pushed = true;
+    }
+
+    record_batch(dev, time);
+    record_read_delay(batch, time);
+
+    size_t staged_count = 0;
+    for (size_t j = 0; j < batch->committed; j++) {
+        if (stage_event(devices, dev->index, &batch->elems[j], time, &staged[staged_count])) staged_count++;
+    }
+    consume_batch(batch);
+
+    // If the events do not fit, they are lost and the device state has to be reloaded.
+    if (staged_count > 0) {
+        if (hooks_ring_push(&event_ring, staged, staged_count)) pushed = true;
+        else batch->needs_resync = true;
+    }
+
+    if (batch->needs_resync && dev->fd >= 0) {
+        batch->needs_resync = !resync_device(arena, dev, time);
+        if (!batch->needs_resync) pushed = true;
+    }
+
+    return pushed;
+}
+
+// The maximum number of ready file descriptors that are handled per wakeup.
+#define HOOKS_MAX_READY 32
+
+static void *run() {
+    NB_Input_Devices *devices = &hooks_devices;
+    struct epoll_event ready[HOOKS_MAX_READY];
+    NBI_Input_Event staged[HOOKS_EVENT_BATCH];
+    Noh_Arena run_arena = noh_arena_init(2 KB);
+    configure_thread("run", hooks_config.run_scheduling, hooks_config.run_priority, hooks_config.run_cpus);
+
+    while (running) {
+        int ready_count = epoll_wait(epoll_fd, ready, HOOKS_MAX_READY, -1);
+        if (ready_count == -1) {
+            if (errno == EINTR) continue;
+
+            noh_log(NOH_ERROR, "Failed to wait for input files: %s", strerror(errno));
+            goto defer;
+        }
+
+        // First drain all devices that have input available, so the whole batch can be applied at once.
+        for (int i = 0; i < ready_count; i++) {
+            if (ready[i].data.ptr == &inotify_fd) {
+                handle_inotify(&run_arena, devices);
+
+                // Handled, don't treat it as a device below.
+                ready[i].data.ptr = NULL;
+                continue;
+            }
+
+            NB_Input_Device *dev = ready[i].data.ptr;
+            if (dev == NULL) {
+                // We were woken up, consume the wakeup and check if we should still be running.
+                uint64_t wakeups;
+                if (read(wake_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+                    noh_log(NOH_WARNING, "Failed to consume wakeup: %s", strerror(errno));
+                }
+                continue;
+            }
+
+            if (ready[i].events & EPOLLIN && dev->fd >= 0) {
+                read_batch(devices, dev->index);
+            }
+
+            if (ready[i].events & (EPOLLERR | EPOLLHUP) && dev->fd >= 0) {
+                // We got a signal that the file descriptor is no longer valid, and we need to close it.
+                close_device(dev);
+            }
+        }
+
+        // Push all complete frames that were read into the event ring.
+        struct timespec time = noh_get_monotonic_time();
+        bool pushed = false;
+        for (int i = 0; i < ready_count; i++) {
+            NB_Input_Device *dev = ready[i].data.ptr;
+            if (dev == NULL) continue;
+
+            if (flush_batch(&run_arena, devices, dev, &time, staged)) pushed = true;
+        }
+
+        // Let the state thread know there are new events.
+        if (pushed) wake_state();
+    }
+
+defer:
+    noh_log(NOH_INFO, "Run shutdown.");
+
+    close_devices(devices);
+
+    noh_arena_free(&run_arena);
+    close(epoll_fd);
+    close(wake_fd);
+    if (inotify_fd >= 0) close(inotify_fd);
+    epoll_fd = -1;
+    wake_fd = -1;
+    inotify_fd = -1;
+
+    pthread_exit(NULL);
+}
+
+// The run thread of the io_uring backend.
+static void *run_uring() {
+    NB_Input_Devices *devices = &hooks_devices;
+    NBI_Input_Event staged[HOOKS_EVENT_BATCH];
+    Noh_Arena run_arena = noh_arena_init(2 KB);
+    configure_thread("run", hooks_config.run_scheduling, hooks_config.run_priority, hooks_config.run_cpus);
+
+    while (running) {
+        // Re-arm everything that completed before, and wait for new completions.
+        if (!uring_enter(&uring, 1)) goto defer;
+
+        struct timespec time = noh_get_monotonic_time();
+        bool pushed = false;
+
+        uint32 head = *uring.cq_head;
+        uint32 tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &uring.cqes[head & uring.cq_mask];
+            uint64 user_data = cqe->user_data;
+            int res = cqe->res;
+
+            if (user_data == HOOKS_URING_IGNORE) continue;
+
+            if (user_data == HOOKS_URING_WAKE) {
+                // We were woken up, consume the wakeup and check if we should still be running.
+                uint64_t wakeups;
+                if (read(wake_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+                    noh_log(NOH_WARNING, "Failed to consume wakeup: %s", strerror(errno));
+                }
+                uring_queue_poll(&uring, wake_fd, HOOKS_URING_WAKE);
+                continue;
+            }
+
+            if (user_data == HOOKS_URING_INOTIFY) {
+                handle_inotify(&run_arena, devices);
+                uring_queue_poll(&uring, inotify_fd, HOOKS_URING_INOTIFY);
+                continue;
+            }
+
+            // A read completed, skip it if it is from before the device was closed.
+            size_t index = user_data & UINT32_MAX;
+            if (index >= devices->count || (uint32)(user_data >> 32) != uring_generations[index]) continue;
+            NB_Input_Device *dev = &devices->elems[index];
+            if (dev->fd < 0) continue;
+
+            if (res < 0 && res != -EAGAIN && res != -EINTR) {
+                // The file descriptor is no longer valid, most likely because the device was removed.
+                noh_log(NOH_ERROR, "Failed reading from device %s: %s", dev->name, strerror(-res));
+                close_device(dev);
+                continue;
+            }
+
+            if (res == 0) {
+                // End of file, evdev devices never return this but replayed devices do when they are removed.
+                close_device(dev);
+                continue;
+            }
+
+            if (res > 0) append_batch(devices, index, res);
+            if (flush_batch(&run_arena, devices, dev, &time, staged)) pushed = true;
+
+            if (dev->fd >= 0) uring_queue_read(&uring, dev);
+        }
+
+        // Hand the completion entries back to the kernel.
+        __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+
+        // Let the state thread know there are new events.
+        if (pushed) wake_state();
+    }
+
+defer:
+    noh_log(NOH_INFO, "Run shutdown.");
+
+    // Cancels all reads that are still in flight before the devices are closed.
+    uring_free(&uring);
+
+    close_devices(devices);
+
+    noh_arena_free(&run_arena);
+    close(wake_fd);
+    if (inotify_fd >= 0) close(inotify_fd);
+    wake_fd = -1;
+    inotify_fd = -1;
+
+    pthread_exit(NULL);
+}
+
+// Find the device at the specified index, returns NULL if out of bounds.
+NB_Input_Device *hooks_find_device_by_index(size_t device_index) {
+    // Devices can be added by the run thread, the count is only increased after the device is filled in.
+    if (device_index >= __atomic_load_n(&hooks_devices.count, __ATOMIC_ACQUIRE)) return NULL;
+    return &hooks_devices.elems[device_index];
+}
+
+
+// The interval in milliseconds at which the pressed keys are checked against the devices, while any are pressed.
+#define CLEANUP_INTERVAL 1000
+
+// Removes keys from the pressed keys lists that are no longer pressed according to the devices themselves.
+// Returns true if any key was removed.
+static bool cleanup_keys() {
+    bool result = false;
+
+    for (size_t i = 0; i < input_state.pressed_keys.count; i++) {
+        NBI_Pressed_Keys_List *list = &input_state.pressed_keys.elems[i];
+        if (list->pressed_count == 0) continue; // No pressed keys to cleanup.
+
+        // There are pressed keys, get a new keymap.
+        NB_Input_Device *dev = hooks_find_device_by_index(list->device_index);
+        if (dev == NULL) continue; // Could not find device.
+
+        // The kernel keymap has the same layout as our bitset, so they can be compared a word at a time.
+        uint64 currently_pressed[NBI_KEY_WORDS] = {0};
+        int queried = query_pressed_keys(dev, currently_pressed, sizeof(currently_pressed));
+        if (queried == 0) {
+            // The device was removed, so none of its keys can still be pressed.
+            hooks_clear_keys_(list);
+            result = true;
+            continue;
+        }
+        if (queried == 2) continue; // The answer may be from another device, check again next time.
+        if (queried < 0) {
+            noh_log(NOH_WARNING, "Could not determine key map of device %s.", dev->name);
+            continue;
+        }
+
+        for (size_t word = 0; word < NBI_KEY_WORDS; word++) {
+            // The keys we think are pressed, but the device does not.
+            uint64 released = list->pressed[word] & ~currently_pressed[word];
+            while (released != 0) {
+                uint16 key = word * 64 + __builtin_ctzll(released);
+                released &= released - 1;
+
+                hooks_add_key_(list, key, false, 0);
+                result = true;
+            }
+        }
+    }
+
+    return result;
+}
+
+// Arms the state timer to go off at the specified monotonic time in nanoseconds, or disarms it if the time is 0.
+static bool arm_state_timer(int64 time) {
+    struct itimerspec timer = {0};
+    timer.it_value.tv_sec = time / (1000 * 1000 * 1000);
+    timer.it_value.tv_nsec = time % (1000 * 1000 * 1000);
+
+    if (timerfd_settime(state_timer_fd, TFD_TIMER_ABSTIME, &timer, NULL) < 0) {
+        noh_log(NOH_ERROR, "Unable to arm state timer: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Owns input_state: applies the events from the event ring, lets the axes decay, cleans up the pressed keys, moves the
+// windows of key presses per second, and publishes a new snapshot whenever anything changed. Only wakes up for new
+// events, or when the state timer goes off for an axis that should decay, pressed keys that should be checked or a key
+// press that leaves its window, so it sleeps while there is no input.
+static void* update_state() {
+    configure_thread("state", NB_Scheduling_Default, 0, hooks_config.state_cpus);
+
+    // The time at which to check the pressed keys, 0 while no keys are pressed.
+    int64 cleanup_at = 0;
+    // The time the state timer is armed for, 0 if it is disarmed.
+    int64 timer_at = 0;
+
+    struct pollfd fds[] = {
+        { .fd = state_fd, .events = POLLIN },
+        { .fd = state_timer_fd, .events = POLLIN },
+    };
+
+    while (running) {
+        struct timespec time = noh_get_monotonic_time();
+        int64 now = noh_get_monotonic_ns();
+        bool changed = hooks_ring_drain(&event_ring, &input_state) > 0;
+
+        if (hooks_decay_axes(&input_state, &time)) changed = true;
+        if (hooks_advance_key_windows(&input_state, now)) changed = true;
+
+        if (cleanup_at != 0 && now >= cleanup_at) {
+            cleanup_at = 0;
+            if (cleanup_keys()) changed = true;
+        }
+        if (cleanup_at == 0 && hooks_any_keys_pressed(&input_state)) {
+            cleanup_at = now + (int64)CLEANUP_INTERVAL * 1000 * 1000;
+        }
+
+        if (changed) {
+            size_t overflows = atomic_load_explicit(&event_ring.overflows, memory_order_relaxed);
+            if (hooks_publish_snapshot(&snapshots, &input_state, overflows)) {
+                notify_change();
+            } else {
+                noh_log(NOH_WARNING, "Input state does not fit in a snapshot buffer of %d bytes.", HOOKS_SNAPSHOT_CAPACITY);
+            }
+        }
+
+        // Wake up for the earliest deadline, or only for new events if there is none.
+        int64 next = hooks_next_decay(&input_state);
+        if (cleanup_at != 0 && (next == 0 || cleanup_at < next)) next = cleanup_at;
+        int64 window_change_at = hooks_next_key_window_change(&input_state);
+        if (window_change_at != 0 && (next == 0 || window_change_at < next)) next = window_change_at;
+        if (next != timer_at) {
+            if (!arm_state_timer(next)) {
+                running = false;
+                break;
+            }
+            timer_at = next;
+        }
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+
+            noh_log(NOH_ERROR, "Unable to wait for state events: %s", strerror(errno));
+            running = false;
+            break;
+        }
+
+        // Consume the wakeup before draining the ring, so no events can be missed.
+        uint64_t counter;
+        if (fds[0].revents & POLLIN && read(state_fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN) {
+            noh_log(NOH_WARNING, "Failed to consume state wakeup: %s", strerror(errno));
+        }
+        if (fds[1].revents & POLLIN) {
+            // The timer went off, it is disarmed until it is armed again.
+            if (read(state_timer_fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN) {
+                noh_log(NOH_WARNING, "Failed to consume state timer: %s", strerror(errno));
+            }
+            timer_at = 0;
+        }
+    }
+
+    noh_log(NOH_INFO, "State shutdown.");
+
+    pthread_exit(NULL);
+}
+
+void hooks_shutdown() {
+    running = false;
+    wake_state();
+
+    // Wake up the run thread, so it does not have to wait for input before noticing it should stop.
+    uint64_t wakeup = 1;
+    if (write(wake_fd, &wakeup, sizeof(wakeup)) < 0) {
+        noh_log(NOH_WARNING, "Failed to wake up run thread: %s", strerror(errno));
+    }
+
+    pthread_join(state_thread, NULL);
+    pthread_join(run_thread, NULL);
+
+    // Only now nothing queries the devices of the source anymore.
+    if (hooks_source->stop != NULL) hooks_source->stop();
+    stop_recording();
+
+    close(state_fd);
+    close(state_timer_fd);
+
+    hooks_ring_free(&event_ring);
+    noh_da_free(&hooks_devices);
+    unlock_memory();
+}
+
+///////////////////////// Probing /////////////////////////
+
+// A device file that was opened, with what identifies the device.
+typedef struct {
+    char path[sizeof(INPUT_BASE_PATH "/") + NAME_MAX];
+    int fd; // -1 if the file could not be opened as a device.
+    char name[256];
+    char phys[256];
+    struct input_id id;
+    const Hooks_Cached_Device *cached; // The capabilities of the device.
+} Hooks_Opened_Device;
+
+// Opens the device file at the path of the opened device, and determines the identity of the device. Finds its
+// capabilities in the cache, or queries them if it is not cached. Returns false if it is not a device that can be
+// opened. Can be called from any thread.
+static bool open_device_file(Hooks_Opened_Device *opened) {
+    opened->fd = -1;
+
+    // Check that it is not a directory.
+    struct stat statbuf;
+    if (stat(opened->path, &statbuf) == -1) return false;
+    if (S_ISDIR(statbuf.st_mode)) return false;
+
+    int fd;
+    if ((fd = open(opened->path, O_RDONLY | O_NONBLOCK)) < 0) {
+        return false;
+    }
+
+    // Determine the device name.
+    memset(opened->name, 0, sizeof(opened->name));
+    if(ioctl(fd, EVIOCGNAME(sizeof(opened->name)), opened->name) < 0) {
+        noh_log(NOH_WARNING, "Could not get device name for device %s.", opened->path);
+        close(fd);
+        return false;
+    }
+
+    // Determine the physical device path.
+    memset(opened->phys, 0, sizeof(opened->phys));
+    if(ioctl(fd, EVIOCGPHYS(sizeof(opened->phys)), opened->phys) < 0) {
+        noh_log(NOH_WARNING, "Could not get physical path for device %s.", opened->path);
+        close(fd);
+        return false;
+    }
+
+    // Determine the bus, vendor, product and version of the device.
+    if (ioctl(fd, EVIOCGID, &opened->id) < 0) {
+        noh_log(NOH_WARNING, "Could not get the id of device %s.", opened->path);
+        close(fd);
+        return false;
+    }
+
+    // A cached entry is checked before any of its answers are used, the device may have changed with the same identity,
+    // e.g. after a firmware update.
+    opened->cached = find_cached_device(&opened->id, opened->name, opened->phys);
+    if (opened->cached != NULL && !cached_device_current(fd, opened->cached)) {
+        noh_log(NOH_INFO, "Cached capabilities of device %s are outdated, querying them again.", opened->path);
+        opened->cached = NULL;
+    }
+    if (opened->cached == NULL) opened->cached = cache_device(fd, &opened->id, opened->name, opened->phys);
+
+    opened->fd = fd;
+    return true;
+}
+
+// Adds an opened device to the list of devices, or reuses the index it had if it was known before, in this run or in
+// the cache. Returns the index of the device, or -1 if there is no room for it, in which case its file is closed.
+// Uses the provided arena to store the strings of the device. Only free up when the device is no longer needed.
+static int add_opened_device(Noh_Arena *arena, NB_Input_Devices *devices, Hooks_Opened_Device *opened) {
+    // If this device was connected before, give it back its old index so everything referring to it keeps working.
+    // Otherwise take the first index that no device in the cache has.
+    int index = -1;
+    for (size_t i = 0; i < devices->count; i++) {
+        NB_Input_Device *dev = &devices->elems[i];
+        if (dev->fd >= 0) continue;
+
+        if (cached_devices[i] != NULL && cached_device_is(cached_devices[i], &opened->id, opened->name, opened->phys)) {
+            index = i;
+            break;
+        }
+        if (index < 0 && cached_devices[i] == NULL && dev->name[0] == '\0') index = i;
+    }
+
+    if (index < 0 && devices->count >= NBI_MAX_DEVICES) {
+        noh_log(NOH_WARNING, "Ignoring device %s, the maximum of %d devices is reached.", opened->path, NBI_MAX_DEVICES);
+        close(opened->fd);
+        return -1;
+    }
+
+    // Keep the time the device was last seen up to date, so it is not dropped from the cache.
+    const Hooks_Cached_Device *cached = opened->cached;
+    if (time(NULL) - cached->last_seen > HOOKS_CACHE_SEEN_INTERVAL) {
+        Hooks_Cached_Device seen = *cached;
+        seen.last_seen = time(NULL);
+        cached = create_cached_device(&seen);
+    }
+
+    if (index >= 0) {
+        NB_Input_Device *dev = &devices->elems[index];
+        if (dev->name[0] == '\0') {
+            dev->type = cached->type;
+            dev->name = noh_arena_strdup(arena, opened->name);
+            dev->physical_path = noh_arena_strdup(arena, opened->phys);
+        }
+
+        // The device file may have a different path than before.
+        if (strcmp(dev->path, opened->path) != 0) dev->path = noh_arena_strdup(arena, opened->path);
+        cached_devices[index] = cached;
+        set_device_fd(dev, opened->fd);
+        return index;
+    }
+
+    NB_Input_Device device = {0};
+    device.type = cached->type;
+    device.fd = opened->fd;
+    device.path = noh_arena_strdup(arena, opened->path);
+    device.name = noh_arena_strdup(arena, opened->name);
+    device.physical_path = noh_arena_strdup(arena, opened->phys);
+
+    // The elements are allocated for the maximum number of devices, so they never move. Only publish the new count
+    // after the device is filled in, since other threads may be looking up devices.
+    device.index = devices->count; // The current count will be the index of this device.
+    cached_devices[device.index] = cached;
+    devices->elems[device.index] = device;
+    __atomic_store_n(&devices->count, device.index + 1, __ATOMIC_RELEASE);
+
+    return device.index;
+}
+
+// Opens the device at the specified path and adds it to the list of devices, or reuses the index it had if it was
+// known before. Returns the index of the device, or -1 if it could not be opened.
+// Uses the provided arena to store the strings of the device. Only free up when the device is no longer needed.
+static int open_device(Noh_Arena *arena, NB_Input_Devices *devices, const char *device_path) {
+    Hooks_Opened_Device opened = {0};
+    if (snprintf(opened.path, sizeof(opened.path), "%s", device_path) >= (int)sizeof(opened.path)) return -1;
+    if (!open_device_file(&opened)) return -1;
+
+    return add_opened_device(arena, devices, &opened);
+}
+
+typedef struct {
+    Hooks_Opened_Device *elems;
+    size_t count;
+    size_t capacity;
+} Hooks_Opened_Devices;
+
+// Opens one of the device files found by init_devices.
+static void open_device_task(void *context, size_t index) {
+    Hooks_Opened_Devices *opened = context;
+    open_device_file(&opened->elems[index]);
+}
+
+// Helper to fill in the list of known devices. The device files are opened at the same time, since every device that
+// is slow to answer would otherwise hold up all others. They are added in the order of the input directory.
+// Uses the provided arena to fill up all data needed in the devices parameter. Only free up when this parameter is no
+// longer needed.
+static bool init_devices(Noh_Arena *arena, NB_Input_Devices *devices) {
+    noh_assert(devices);
+    devices->default_kb_idx = -1;
+    devices->default_mouse_idx = -1;
+    devices->elems = noh_realloc_check(devices->elems, NBI_MAX_DEVICES * sizeof(NB_Input_Device));
+    devices->capacity = NBI_MAX_DEVICES;
+
+    noh_arena_reserve(arena, 10 KB);
+
+    DIR *input_dir;
+    struct dirent *dir;
+    input_dir = opendir(INPUT_BASE_PATH);
+    if (!input_dir) {
+        noh_log(NOH_ERROR, "Could not load input files directory: %s", strerror(errno));
+        return false;
+    }
+
+    // Devices in the cache keep their index, even when they are not connected.
+    load_capability_cache(arena, devices);
+
+    Hooks_Opened_Devices opened = {0};
+
+    while ((dir = readdir(input_dir)) != NULL) {
+        Noh_String_View dir_sv = noh_sv_from_cstr(dir->d_name);
+        if (noh_sv_eq(dir_sv, noh_sv_from_cstr("."))) continue;
+        if (noh_sv_eq(dir_sv, noh_sv_from_cstr(".."))) continue;
+        if (!noh_sv_starts_with(dir_sv, noh_sv_from_cstr("event"))) continue;
 
-// Also includes noh.h
-#include "hooks.c" // Common code used by all platforms.
+        // Build up full path to device.
+        Hooks_Opened_Device device = { .fd = -1 };
+        snprintf(device.path, sizeof(device.path), "%s/%s", INPUT_BASE_PATH, dir->d_name);
+        noh_da_append(&opened, device);
+    }
 
-static bool running = false;
+    closedir(input_dir);
 
-// This arena is used all throughout this file for storing temporary data.
-static Noh_Arena hooks_arena = {0};
+    run_parallel(opened.count, open_device_task, &opened);
+    for (size_t i = 0; i < opened.count; i++) {
+        if (opened.elems[i].fd >= 0) add_opened_device(arena, devices, &opened.elems[i]);
+    }
 
-NB_Input_Devices hooks_devices = {0};
-struct pollfd *poll_fds;
+    noh_da_free(&opened);
 
-static sem_t cleanup_sem;
-static pthread_t cleanup_thread;
+    // Write the devices that were not cached yet right away, rather than only when shutting down.
+    save_capability_cache(devices);
+    return 1;
+}
 
-static pthread_t run_thread;
+// Saves and frees the capability cache, once nothing queries the devices anymore.
+static void stop_evdev() {
+    free_capability_cache(&hooks_devices);
+}
 
-// An input event from a /dev/input file stream.
-typedef struct {
-    struct timeval time;
-    uint16 type;
-    uint16 code;
-    uint value;
-} Input_Event;
+static const Hooks_Device_Source evdev_source = {
+    .init_devices = init_devices,
+    .query = evdev_query,
+    .stop = stop_evdev,
+    .hotplug = true
+};
+
+// Defines the contacts of a multi-touch device, and fills in the contacts that are currently on it. Also defines the
+// axes that the gestures made on the device are reported through.
+static void probe_touches(NBI_Input_State *state, NB_Input_Device *dev, const struct timespec *time) {
+    struct input_absinfo slot_info, x_info, y_info;
+    size_t slot_count = touch_slot_count(dev, &slot_info);
+    if (slot_count == 0) return;
+    if (load_axis_info(dev, ABS_MT_POSITION_X, &x_info) < 0) return;
+    if (load_axis_info(dev, ABS_MT_POSITION_Y, &y_info) < 0) return;
+
+    NBI_Touch_Contacts *contacts = hooks_define_touch_contacts(
+        state, dev, slot_count, x_info.minimum, x_info.maximum, y_info.minimum, y_info.maximum);
+    contacts->current_slot = slot_info.value >= 0 ? (size_t)slot_info.value : slot_count;
+
+    for (uint16 axis_id = NB_Gesture_Swipe_2_X; axis_id < NB_Gesture_End; axis_id++) {
+        hooks_define_rel_axis(state, dev, axis_id, time);
+    }
 
-NBI_Input_State input_state = {0};
-pthread_mutex_t input_mutex = PTHREAD_MUTEX_INITIALIZER;
+    // If any of these fail, the slots remain empty until the next contacts are reported.
+    if (load_touch_slots(dev, ABS_MT_TRACKING_ID, contacts->tracking_ids, slot_count) &&
+        load_touch_slots(dev, ABS_MT_POSITION_X, contacts->x, slot_count)) {
+        load_touch_slots(dev, ABS_MT_POSITION_Y, contacts->y, slot_count);
+    }
+    hooks_reset_gesture(contacts);
+}
+
+// Helper to fill in the currently pressed keys and axes of a single device. Only touches the specified state, so
+// devices can be probed at the same time into separate states.
+static void probe_device(NBI_Input_State *state, NB_Input_Device *dev) {
+    // Check the device's capabilities.
+    uint8 capabilities[HOOKS_BITMAP_SIZE(EV_CNT)];
+    if (!load_capability_map(dev, capabilities)) return;
+
+    // Fill in pressed keys if keys are supported.
+    if (test_bit(capabilities, sizeof(capabilities), EV_KEY)) {
+        NBI_Pressed_Keys_List *list = hooks_define_key_list(state, dev);
+        uint8 pressed_at_start[HOOKS_BITMAP_SIZE(KEY_CNT)];
+        if (load_keymap(dev, pressed_at_start)) {
+            for_each_set_bit(key, pressed_at_start, 1, KEY_MAX) {
+                hooks_add_key_(list, key, true, 0);
+            }
+        }
+    }
 
-static int load_capability_map(Noh_Arena *arena, NB_Input_Device *dev, uint8 **capabilities) {
-    static size_t len = (EV_MAX / sizeof(uint8) + 1) * sizeof(uint8);
+    struct timespec time = noh_get_monotonic_time();
 
-    // Allocate some zeroed memory.
-    *capabilities = noh_arena_alloc(arena, len);
-    memset(*capabilities, 0, len);
+    // Fill in absolute axes if abs is supported.
+    uint8 abs_map[HOOKS_BITMAP_SIZE(ABS_CNT)];
+    if (test_bit(capabilities, sizeof(capabilities), EV_ABS) && load_abs_map(dev, abs_map)) {
+        // The contacts of multi-touch devices are tracked per slot, not as separate axes.
+        bool has_slots = test_bit(abs_map, sizeof(abs_map), ABS_MT_SLOT);
+        if (has_slots) probe_touches(state, dev, &time);
 
-    // Load the keymap from the device.
-    if (ioctl(dev->fd, EVIOCGBIT(0, EV_MAX), *capabilities) < 0) {
-        noh_log(NOH_WARNING, "Could not determine capabilities of device %s.", dev->name);
-        return -1;
+        for_each_set_bit(axis_id, abs_map, 0, ABS_MAX) {
+            if (has_slots && is_mt_code(axis_id)) continue;
+
+            // This is a supported axis, get its state.
+            struct input_absinfo abs_feat;
+            if (load_axis_info(dev, axis_id, &abs_feat) < 0) continue;
+
+            // Flat and fuzz are applied to the events of this axis by the run thread, start from the value as that
+            // filter passes it on.
+            Input_Axis_Filter filter = {0};
+            int value = reset_abs_filter(&filter, &abs_feat);
+            hooks_define_abs_axis(state, dev, axis_id, &time, value, abs_feat.minimum, abs_feat.maximum);
+        }
+    }
+
+    // Fill in relative axes if rel is supported.
+    uint8 rel_map[HOOKS_BITMAP_SIZE(REL_CNT)];
+    if (test_bit(capabilities, sizeof(capabilities), EV_REL) && load_rel_map(dev, rel_map)) {
+        for_each_set_bit(axis_id, rel_map, 0, REL_MAX) {
+            hooks_define_rel_axis(state, dev, axis_id, &time);
+        }
     }
+}
 
-    // Return the length.
-    return len;
+// The devices fill_current_state probes, and the states they are probed into.
+typedef struct {
+    NB_Input_Devices *devices;
+    NBI_Input_State *states;
+} Hooks_Probe_Task;
+
+// Probes a device into its own state, for fill_current_state.
+static void probe_device_task(void *context, size_t index) {
+    Hooks_Probe_Task *task = context;
+    NB_Input_Device *dev = &task->devices->elems[index];
+    if (dev->fd >= 0) probe_device(&task->states[index], dev); // Devices that are not connected are probed when they are.
 }
 
-static int load_keymap(Noh_Arena *arena, NB_Input_Device *dev, uint8 **keys) {
-    static size_t len = (KEY_MAX / sizeof(uint8) + 1) * sizeof(uint8);
+// Helper to fill in the currently pressed keys and axes of all devices. The devices are probed at the same time, since
+// every device that is slow to answer would otherwise hold up all others.
+static NBI_Input_State fill_current_state(NB_Input_Devices *devices) {
+    NBI_Input_State state = {0};
 
-    // Allocate some zeroed memory.
-    *keys = noh_arena_alloc(arena, len);
-    memset(*keys, 0, len);
+    Hooks_Probe_Task task = { .devices = devices, .states = calloc(devices->count + 1, sizeof(NBI_Input_State)) };
+    noh_assert(task.states != NULL && "Could not allocate enough memory");
+    run_parallel(devices->count, probe_device_task, &task);
 
-    // Load the keymap from the device.
-    if (ioctl(dev->fd, EVIOCGKEY(len), *keys) < 0) {
-        noh_log(NOH_WARNING, "Could not determine key map of device %s.", dev->name);
-        return -1;
+    // Combine the states in the order of the devices, as if they were probed one after the other.
+    for (size_t i = 0; i < devices->count; i++) {
+        hooks_merge_state(&state, &task.states[i]);
     }
+    free(task.states);
 
-    // Return the length;
-    return len;
+    hooks_build_routes(&state);
+    return state;
 }
 
-static int load_abs_map(Noh_Arena *arena, NB_Input_Device *dev, uint8 **abs_map) {
-    static size_t len = (ABS_MAX / sizeof(uint8) + 1) * sizeof(uint8);
-
-    // Allocate some zeroed memory.
-    *abs_map = noh_arena_alloc(arena, len);
-    memset(*abs_map, 0, len);
+// Starts watching the input directory for devices being added or removed. Returns false if this is not possible.
+static bool watch_input_directory() {
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        noh_log(NOH_WARNING, "Could not watch for new devices: %s", strerror(errno));
+        return false;
+    }
 
-    // Load the absolute map from the device.
-    if (ioctl(dev->fd, EVIOCGBIT(EV_ABS, len), *abs_map) < 0) {
-        noh_log(NOH_WARNING, "Could not determine absolute map of device %s.", dev->name);
-        return -1;
+    if (inotify_add_watch(inotify_fd, INPUT_BASE_PATH, IN_CREATE | IN_ATTRIB | IN_DELETE) < 0) {
+        noh_log(NOH_WARNING, "Could not watch for new devices: %s", strerror(errno));
+        close(inotify_fd);
+        inotify_fd = -1;
+        return false;
     }
 
-    // Return the length.
-    return len;
+    return true;
 }
 
-static int load_rel_map(Noh_Arena *arena, NB_Input_Device *dev, uint8 **rel_map) {
-    static size_t len = (REL_MAX / sizeof(uint8) + 1) * sizeof(uint8);
+// Creates the epoll instance and the wake_fd, and registers all the file descriptors of all devices.
+static bool create_epoll(NB_Input_Devices *devices) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        noh_log(NOH_ERROR, "Could not create epoll instance: %s", strerror(errno));
+        return false;
+    }
 
-    // Allocate some zeroed memory.
-    *rel_map = noh_arena_alloc(arena, len);
-    memset(*rel_map, 0, len);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        noh_log(NOH_ERROR, "Could not create wakeup eventfd: %s", strerror(errno));
+        close(epoll_fd);
+        return false;
+    }
 
-    // Load the relative map from the device.
-    if (ioctl(dev->fd, EVIOCGBIT(EV_REL, len), *rel_map) < 0) {
-        noh_log(NOH_WARNING, "Could not determine relative map of device %s.", dev->name);
-        return -1;
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) < 0) {
+        noh_log(NOH_ERROR, "Could not watch wakeup eventfd: %s", strerror(errno));
+        close(wake_fd);
+        close(epoll_fd);
+        return false;
     }
 
-    // Return the length.
-    return len;
-}
+    run_parallel(devices->count, prepare_device_task, devices);
+    for (size_t i = 0; i < devices->count; i++) {
+        if (devices->elems[i].fd >= 0) watch_device(&devices->elems[i]);
+    }
 
-static int load_axis_info(NB_Input_Device *dev, size_t axis_id, struct input_absinfo *abs_feat) {
-    if (ioctl(dev->fd, EVIOCGABS(axis_id), abs_feat)) {
-        noh_log(NOH_WARNING, "Unable to get info about axis %zu of device %s.", axis_id, dev->name);
-        return -1;
+    // Watch for devices being added or removed. Without it we still work, just without hotplugging. A replay has no
+    // devices other than the ones in the recording.
+    if (hooks_source->hotplug && watch_input_directory()) {
+        event.data.ptr = &inotify_fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inotify_fd, &event) < 0) {
+            noh_log(NOH_WARNING, "Could not watch for new devices: %s", strerror(errno));
+            close(inotify_fd);
+            inotify_fd = -1;
+        }
     }
 
-    return 0;
+    return true;
 }
 
-static bool test_bit(uint8 *keymap, size_t keymap_len, uint16 key) {
-    if (key / 8 > keymap_len) return false;
+// Creates the io_uring instance and the wake_fd, and queues reads for all devices. Returns false if io_uring is not
+// available.
+static bool create_uring(NB_Input_Devices *devices) {
+    if (!uring_setup(&uring)) return false;
 
-    uint8 index = key / 8;
-    uint8 offset = key % 8;
-    return (keymap[index] & (1 << offset)) > 0;
-}
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        noh_log(NOH_ERROR, "Could not create wakeup eventfd: %s", strerror(errno));
+        uring_free(&uring);
+        return false;
+    }
+    uring_queue_poll(&uring, wake_fd, HOOKS_URING_WAKE);
 
-static void *run() {
-    Input_Event event = {0};
-    NB_Input_Devices *devices = &hooks_devices;
+    run_parallel(devices->count, prepare_device_task, devices);
+    for (size_t i = 0; i < devices->count; i++) {
+        if (devices->elems[i].fd >= 0) watch_device(&devices->elems[i]);
+    }
 
-    while (running) {
-        int poll_result = poll(poll_fds, devices->count, 500);
-        if (poll_result == -1) {
-            noh_log(NOH_ERROR, "Failed to poll input files: %s", strerror(errno));
-            goto defer;
-        }
+    if (hooks_source->hotplug && watch_input_directory()) {
+        uring_queue_poll(&uring, inotify_fd, HOOKS_URING_INOTIFY);
+    }
 
-        // 0 result means a timeout, so check if we should still be running.
-        if (poll_result == 0) continue;
+    return true;
+}
 
-        for (size_t i = 0; i < devices->count; i++) {
-            // Find the device and the poll_fd for this index.
-            NB_Input_Device *dev = &devices->elems[i];
-            struct pollfd *poll_fd = &poll_fds[i];
+///////////////////////// Described devices /////////////////////////
 
-            if (poll_fd->revents & POLLIN) {
-                int bytes_read = read(poll_fd->fd, &event, sizeof(event));
-                if (bytes_read < 0) {
-                    noh_log(NOH_ERROR, "error: %s", strerror(errno));
-                    continue;
-                } else if (bytes_read != sizeof(event)) {
-                    noh_log(NOH_ERROR, "Expected to read %zu bytes, but got %zu", sizeof(event), read);
-                    continue;
-                }
+// Devices that are not evdev devices are described by a Hooks_Device_Description, and backed by a socket. Their
+// events are written into one end of it, the run thread reads them from the other end like it would read from an
+// evdev device.
 
-                // We got a valid event, handle it.
-                switch(event.type) {
-                    case EV_KEY:
-                        // Only check up and down events.
-                        if (event.value != 0 && event.value != 1) break;
-
-                        if (devices->default_kb_idx == -1 && 
-                            event.code >= KEY_ESC && event.code <= KEY_COMPOSE) {
-                            // Mark this device as default keyboard.
-                            devices->default_kb_idx = i;
-                        }
-
-                        if (devices->default_mouse_idx == -1 &&
-                            (event.code == BTN_LEFT || event.code == BTN_RIGHT || event.code == BTN_MIDDLE)) {
-                            // Mark this device as default mouse.
-                            devices->default_mouse_idx = i;
-                        }
-
-                        pthread_mutex_lock(&input_mutex);
-                        hooks_add_key(&input_state, dev->index, event.code, event.value == 1); 
-                        pthread_mutex_unlock(&input_mutex);
-                        break;
-                    case EV_ABS:
-                        {
-                            struct timespec tim = noh_get_time_in(0, 0);
-                            pthread_mutex_lock(&input_mutex);
-                            hooks_add_abs_value(&input_state, dev->index, event.code, &tim, event.value);
-                            pthread_mutex_unlock(&input_mutex);
-                            break;
-                        }
-                    case EV_REL:
-                        if (devices->default_mouse_idx == -1) {
-                            // Mark this device as default mouse.
-                            devices->default_mouse_idx = i;
-                        }
-
-                        struct timespec time = noh_get_time_in(0, 0);
-                        pthread_mutex_lock(&input_mutex);
-                        hooks_add_rel_value(&input_state, dev->index, event.code, &time, event.value);
-                        pthread_mutex_unlock(&input_mutex);
-                        break;
-                    default:
-                       break;
-                }
+// The sockets the events of the described devices are written into, by device index. -1 once a device is removed.
+static int described_fds[NBI_MAX_DEVICES];
 
-            } else if (poll_fd->revents & (POLLERR | POLLHUP)) {
-                // We got a signal that the file descriptor is no longer valid, and we need to close it.
-                // The device will still be listed until the hooks are reset, but no input will come from it anymore.
-                noh_log(NOH_WARNING, "closing fd %d\n", poll_fd->fd);
-                close(poll_fd->fd);
-                poll_fd->events *= -1;
-            }
-        }
+// Adds a described device to the list of devices at the specified index, ownership of the description moves to the
+// hooks. Indexes before it that have no device yet are filled with devices that are not connected, like the devices
+// from the capability cache. Returns false if its socket could not be created.
+static bool add_described_device(Noh_Arena *arena, NB_Input_Devices *devices, size_t index,
+                                 Hooks_Device_Description *described) {
+    if (index >= NBI_MAX_DEVICES) {
+        noh_log(NOH_WARNING, "Ignoring device %s, the maximum of %d devices is reached.", described->name, NBI_MAX_DEVICES);
+        return false;
     }
+    noh_assert(index >= devices->count || described_devices[index] == NULL);
 
-defer:
-    noh_log(NOH_INFO, "Run shutdown.");
+    // A socket rather than a pipe, so writing to a device that was closed by the run thread does not raise SIGPIPE.
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, fds) < 0) {
+        noh_log(NOH_ERROR, "Could not create device %s: %s", described->name, strerror(errno));
+        return false;
+    }
 
-    for (size_t i = 0; i < devices->count; i++) {
-        NB_Input_Device *dev = &devices->elems[i];
-        if (close(dev->fd) != 0) {
-            noh_log(NOH_WARNING, "Failed closing input device %s: %s", dev->name, strerror(errno));
-        }
+    NB_Input_Device device = {0};
+    device.type = device_type_from_name(described->name);
+    device.fd = fds[0];
+    device.path = noh_arena_strdup(arena, described->path);
+    device.name = noh_arena_strdup(arena, described->name);
+    device.physical_path = noh_arena_strdup(arena, described->phys);
+    device.index = index;
+
+    while (devices->count < index) {
+        devices->elems[devices->count] = (NB_Input_Device){ .fd = -1, .path = "", .name = "", .physical_path = "",
+                                                            .index = devices->count };
+        devices->count++;
     }
 
-    pthread_exit(NULL);
+    described_devices[device.index] = described;
+    described_fds[device.index] = fds[1];
+    devices->elems[device.index] = device;
+    if (index == devices->count) __atomic_store_n(&devices->count, device.index + 1, __ATOMIC_RELEASE);
+    return true;
 }
 
-// Find the device at the specified index, returns NULL if out of bounds.
-NB_Input_Device *hooks_find_device_by_index(size_t device_index) {
-    if (device_index >= hooks_devices.count) return NULL;
-    return &hooks_devices.elems[device_index];
+// Prepares an empty list of devices for a source to add its described devices to.
+static void init_described_devices(NB_Input_Devices *devices) {
+    noh_assert(devices);
+    devices->default_kb_idx = -1;
+    devices->default_mouse_idx = -1;
+    devices->elems = noh_realloc_check(devices->elems, NBI_MAX_DEVICES * sizeof(NB_Input_Device));
+    devices->capacity = NBI_MAX_DEVICES;
+    for (size_t i = 0; i < NBI_MAX_DEVICES; i++) described_fds[i] = -1;
 }
 
+// Keeps the pressed keys in the description of a device up to date with an event that is about to be written.
+static void update_described_keys(Hooks_Device_Description *described, const Input_Event *event) {
+    if (event->type != EV_KEY || event->code >= KEY_CNT || (event->value != 0 && event->value != 1)) return;
 
-#define CLEANUP_INTERVAL 1000
-#define SMOOTH_INTERVAL 100
+    uint8 bit = 1 << (event->code % 8);
+    if (event->value == 1) __atomic_fetch_or(&described->pressed[event->code / 8], bit, __ATOMIC_RELAXED);
+    else __atomic_fetch_and(&described->pressed[event->code / 8], (uint8)~bit, __ATOMIC_RELAXED);
+}
 
-static void* cleanup() {
-    Noh_Arena cleanup_arena = noh_arena_init(2 KB);
+// Writes events into the socket of a described device, timestamped with the current time. Waits while the run thread
+// is behind, unless stop_fd becomes readable. Events for a device that was closed are dropped. Returns false if
+// writing was stopped or failed.
+static bool write_described_events(size_t device_index, Input_Event *events, size_t count, int stop_fd) {
+    int fd = described_fds[device_index];
+    if (fd < 0 || count == 0) return true;
+
+    // Keep the pressed keys up to date before the events are written, for when the keys are checked by cleanup_keys.
+    struct timespec now = noh_get_monotonic_time();
+    for (size_t i = 0; i < count; i++) {
+        events[i].time.tv_sec = now.tv_sec;
+        events[i].time.tv_usec = now.tv_nsec / 1000;
+        update_described_keys(described_devices[device_index], &events[i]);
+    }
 
-    struct timespec last_cleanup = noh_get_time_in(0, 0);
+    char *data = (char *)events;
+    size_t remaining = count * sizeof(Input_Event);
+    while (remaining > 0) {
+        ssize_t written = send(fd, data, remaining, MSG_NOSIGNAL);
+        if (written >= 0) {
+            data += written;
+            remaining -= written;
+            continue;
+        }
 
-    while (running) {
-        struct timespec time = noh_get_time_in(0, 0);
-        struct timespec timeout = time;
-        noh_time_add(&timeout, 0, SMOOTH_INTERVAL);
-
-        // Fill relative and absolute histories with zeroes, so they tend back to 0.
-        for (size_t i = 0; i < input_state.axes.count; i++) {
-            NBI_Axis_History *history = &input_state.axes.elems[i];
-            // Add a 0 if the last update was at least half a second before.
-            if (noh_diff_timespec_ms(&history->last_updated_at, &time) > -SMOOTH_INTERVAL) continue;
-
-            // Fill in relative even for absolute, so no absolute value is overwritten.
-            hooks_add_rel_value_(history, &time, 0);
-        }
-
-        if (noh_diff_timespec_ms(&time, &last_cleanup) < CLEANUP_INTERVAL) continue;
-        last_cleanup = noh_get_time_in(0, 0);
-
-        // Cleanup pressed keys using load_keymap.
-        noh_arena_save(&cleanup_arena);
-        pthread_mutex_lock(&input_mutex);
-        for (size_t i = 0; i < input_state.pressed_keys.count; i++) {
-            NBI_Pressed_Keys_List *list = &input_state.pressed_keys.elems[i];
-            if (list->count <= 0) continue; // No pressed keys to cleanup.
-
-            // There are pressed keys, get a new keymap.
-            NB_Input_Device *dev = hooks_find_device_by_index(list->device_index);
-            if (dev == NULL) continue; // Could not find device.
-
-            uint8 *currently_pressed;
-            size_t keymap_len = load_keymap(&cleanup_arena, dev, &currently_pressed);
-            if (keymap_len < 0) continue; // Could not load keymap.
-            if (keymap_len == 0) {
-                noh_da_reset(list); // Remove all keys
-            } else {
-                // Some keys are still pressed, check all of them against the loaded keymap.
-                // Remove keys from the back forward so we don't mess with the indexes of keys still to check.
-                // Use a long and not size_t for j, since we need it to be able to go below 0 to exit the loop.
-                for (long j = list->count - 1; j >= 0; j--) {
-                    if (!test_bit(currently_pressed, keymap_len, list->elems[j])) {
-                        noh_da_remove_at(list, (size_t)j);
-                    }
-                }
-            }
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            // The run thread closed the device, its remaining events are dropped.
+            return true;
         }
 
-        pthread_mutex_unlock(&input_mutex);
-        noh_arena_rewind(&cleanup_arena);
+        // A negative stop_fd is ignored by poll.
+        struct pollfd fds[] = {
+            { .fd = fd, .events = POLLOUT },
+            { .fd = stop_fd, .events = POLLIN },
+        };
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) return false;
+        if (fds[1].revents & POLLIN) return false;
+    }
 
-        // Wait for next run, or stop if signalled earlier.
-        int res = sem_timedwait(&cleanup_sem, &timeout);
-        if (res < 0) {
-            if (errno == ETIMEDOUT) continue;
+    return true;
+}
 
-            noh_log(NOH_ERROR, "Unable to wait for semaphore: %s", strerror(errno));
-            running = false;
-        }
-    }
+// Removes a described device, the run thread then removes it like an evdev device that was unplugged.
+static void remove_described_device(size_t device_index) {
+    if (described_fds[device_index] >= 0) close(described_fds[device_index]);
+    described_fds[device_index] = -1;
+}
 
-    noh_log(NOH_INFO, "Cleanup shutdown.");
-    sem_destroy(&cleanup_sem);
+// Frees all described devices.
+static void free_described_devices() {
+    for (size_t i = 0; i < NBI_MAX_DEVICES; i++) {
+        if (described_devices[i] == NULL) continue;
 
-    pthread_exit(NULL);
+        remove_described_device(i);
+        free(described_devices[i]);
+        described_devices[i] = NULL;
+    }
 }
 
-void hooks_shutdown() {
-    running = false;
-    sem_post(&cleanup_sem);
+///////////////////////// Replay /////////////////////////
 
-    pthread_join(cleanup_thread, NULL);
-    pthread_join(run_thread, NULL);
+// Replaying feeds the events of a recording through the same path as the events of real devices. Every recorded
+// device is added as a described device, and the replay thread writes the recorded events into it.
 
-    noh_da_free(&hooks_devices);
-}
+// The recording being replayed, or NULL if not replaying.
+static FILE *replay_file = NULL;
 
-// Helper to fill in the list of known devices.
-// Uses the provided arena to fill up all data needed in the devices parameter. Only free up when this parameter is no
-// longer needed.
-static bool init_devices(Noh_Arena *arena, NB_Input_Devices *devices) {
-    noh_assert(devices);
-    devices->default_kb_idx = -1;
-    devices->default_mouse_idx = -1;
+// An eventfd that is written to in order to stop the replay thread.
+static int replay_stop_fd = -1;
 
-    #define INPUT_BASE_PATH "/dev/input"
-    noh_arena_reserve(arena, 10 KB);
+// A timerfd the replay thread waits on until the next event is due.
+static int replay_timer_fd = -1;
 
-    DIR *input_dir;
-    struct dirent *dir;
-    input_dir = opendir(INPUT_BASE_PATH);
-    if (!input_dir) {
-        noh_log(NOH_ERROR, "Could not load input files directory: %s", strerror(errno));
+static pthread_t replay_thread;
+
+// Opens the recording at hooks_config.replay_path and fills in the list of devices with the devices in it, instead of
+// the devices in the input directory. Every device that appears anywhere in the recording is added right away.
+static bool init_replay_devices(Noh_Arena *arena, NB_Input_Devices *devices) {
+    const char *path = hooks_config.replay_path;
+    init_described_devices(devices);
+
+    replay_file = fopen(path, "rb");
+    if (replay_file == NULL) {
+        noh_log(NOH_ERROR, "Could not open recording %s: %s", path, strerror(errno));
         return false;
     }
 
-    Noh_String device_path = {0};
-    struct stat statbuf;
+    char magic[sizeof(HOOKS_RECORD_MAGIC) - 1];
+    if (fread(magic, sizeof(magic), 1, replay_file) != 1 || memcmp(magic, HOOKS_RECORD_MAGIC, sizeof(magic)) != 0) {
+        noh_log(NOH_ERROR, "%s is not a recording.", path);
+        return false;
+    }
+    long start = ftell(replay_file);
 
-    while ((dir = readdir(input_dir)) != NULL) {
-        Noh_String_View dir_sv = noh_sv_from_cstr(dir->d_name);
-        if (noh_sv_eq(dir_sv, noh_sv_from_cstr("."))) continue;
-        if (noh_sv_eq(dir_sv, noh_sv_from_cstr(".."))) continue;
-        if (!noh_sv_starts_with(dir_sv, noh_sv_from_cstr("event"))) continue;
+    Hooks_Record record;
+    while (fread(&record, sizeof(record), 1, replay_file) == 1) {
+        if (record.type != HOOKS_RECORD_DEVICE) continue;
 
-        // Build up full path to device.
-        noh_string_reset(&device_path);
-        noh_string_append_cstr(&device_path, INPUT_BASE_PATH);
-        noh_string_append_cstr(&device_path, "/");
-        noh_string_append_cstr(&device_path, dir->d_name);
-        noh_string_append_null(&device_path);
-
-        // Check that it is not a directory.
-        if (stat(device_path.elems, &statbuf) == -1) continue;
-        if (S_ISDIR(statbuf.st_mode)) continue;
-
-        int fd;
-        if ((fd = open(device_path.elems, O_RDONLY | O_NONBLOCK)) < 0) {
-            continue;
+        Hooks_Device_Description *recorded = noh_realloc_check(NULL, sizeof(Hooks_Device_Description));
+        if (fread(recorded, sizeof(Hooks_Device_Description), 1, replay_file) != 1) {
+            // The recording was cut off, replay what is there.
+            free(recorded);
+            break;
         }
 
-        // Determine the device name.
-        char *name = noh_arena_alloc(arena, 256);
-        if(ioctl(fd, EVIOCGNAME(256), name) < 0) {
-            noh_log(NOH_WARNING, "Could not get device name for device %s.", device_path.elems);
+        if (record.device_index < devices->count && described_devices[record.device_index] != NULL) {
+            // The device was connected again, it keeps its first description.
+            free(recorded);
             continue;
         }
 
-        // Determine the physical device path.
-        char *phys = noh_arena_alloc(arena, 256);
-        if(ioctl(fd, EVIOCGPHYS(256), phys) < 0) {
-            noh_log(NOH_WARNING, "Could not get physical path for device %s.", device_path.elems);
-            continue;
+        // Indexes of devices that were not connected while recording stay as devices that are not connected.
+        if (!add_described_device(arena, devices, record.device_index, recorded)) {
+            free(recorded);
+            return false;
         }
+    }
 
-        NB_Input_Device device = {0};
-        device.type = NB_Unknown;
-        device.fd = fd;
-        device.path = noh_arena_strdup(arena, device_path.elems);
-        device.name = name;
-        device.physical_path = phys;
+    fseek(replay_file, start, SEEK_SET);
+    noh_log(NOH_INFO, "Replaying %zu devices from %s.", devices->count, path);
+    return true;
+}
 
-        // Try to determine the device type based on the name.
-        // Later we can use key and relative events to add another way to determine.
-        // FUTURE: Is there not a better way to find this out?
-        if (noh_sv_contains_ci(noh_sv_from_cstr(device.name), noh_sv_from_cstr("mouse")))
-            device.type = NB_Mouse;
-        if (noh_sv_contains_ci(noh_sv_from_cstr(device.name), noh_sv_from_cstr("keyboard")))
-            device.type = NB_Keyboard;
-        if (noh_sv_contains_ci(noh_sv_from_cstr(device.name), noh_sv_from_cstr("touchpad")))
-            device.type = NB_Touchpad;
+// Waits until the specified monotonic time in nanoseconds. Returns false if the replay should stop instead.
+static bool replay_wait(int64 until) {
+    if (noh_get_monotonic_ns() >= until) return true;
 
-        device.index = devices->count; // The current count will be the index of this device.
-        noh_da_append(devices, device);
+    struct itimerspec timer = {0};
+    timer.it_value.tv_sec = until / (1000 * 1000 * 1000);
+    timer.it_value.tv_nsec = until % (1000 * 1000 * 1000);
+    if (timerfd_settime(replay_timer_fd, TFD_TIMER_ABSTIME, &timer, NULL) < 0) {
+        noh_log(NOH_ERROR, "Unable to arm replay timer: %s", strerror(errno));
+        return false;
     }
 
-    closedir(input_dir);
-    noh_string_free(&device_path);
+    struct pollfd fds[] = {
+        { .fd = replay_timer_fd, .events = POLLIN },
+        { .fd = replay_stop_fd, .events = POLLIN },
+    };
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
 
-    return 1;
+            noh_log(NOH_ERROR, "Failed waiting for the next replayed event: %s", strerror(errno));
+            return false;
+        }
+        if (fds[1].revents & POLLIN) return false;
+
+        uint64_t expirations;
+        if (read(replay_timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) return false;
+        return true;
+    }
 }
 
-// Helper to fill in the currently pressed keys for all inputs that have keys.
-// Any data used in the arena will be rewound at the end of this function.
-// Strings used in the returned NBI_Input_State will share their memory with the provided NB_Input_Devices.
-static NBI_Input_State fill_current_state(Noh_Arena *arena, NB_Input_Devices *devices) {
-    NBI_Input_State state = {0};
+// Writes the events of the recording into the sockets of the replayed devices, with the timing of the recording or as
+// fast as the run thread reads them.
+static void *replay() {
+    Hooks_Record record;
+    Input_Event frame[HOOKS_EVENT_BATCH];
+    size_t frame_count = 0;
+    size_t frame_device = 0;
+
+    // The difference between the current time and the time in the recording.
+    bool started = false;
+    int64 offset = 0;
+
+    while (fread(&record, sizeof(record), 1, replay_file) == 1) {
+        if (record.type == HOOKS_RECORD_DEVICE) {
+            // All devices were added before starting.
+            if (fseek(replay_file, sizeof(Hooks_Device_Description), SEEK_CUR) != 0) break;
+            continue;
+        }
+        if (record.device_index >= hooks_devices.count) continue;
 
-    // Fill in the keys that are pressed when starting.
-    for (size_t i = 0; i < devices->count; i++) {
-        NB_Input_Device *dev = &devices->elems[i];
+        // Frames of different devices are written separately.
+        if (frame_count > 0 && record.device_index != frame_device) {
+            if (!write_described_events(frame_device, frame, frame_count, replay_stop_fd)) goto defer;
+            frame_count = 0;
+        }
 
-        // Check the device's capabilities.
-        uint8 *capabilities;
-        noh_arena_save(arena);
-        int cap_len = load_capability_map(arena, dev, &capabilities);
-        if (cap_len < 0) continue;
-
-        // Fill in pressed keys if keys are supported.
-        if (test_bit(capabilities, cap_len, EV_KEY)) {
-            NBI_Pressed_Keys_List *list = hooks_define_key_list(&state, dev);
-            uint8 *pressed_at_start;
-            size_t keymap_len = load_keymap(arena, dev, &pressed_at_start);
-            if (keymap_len > 0) {
-                for (uint16 key = 1; key < KEY_MAX; key++) {
-                    if (test_bit(pressed_at_start, keymap_len, key)) {
-                        hooks_add_key_(list, key, true);
-                    }
-                }
-            }
+        if (record.type == HOOKS_RECORD_REMOVED) {
+            remove_described_device(record.device_index);
+            continue;
         }
 
-        struct timespec time = noh_get_time_in(0, 0);
+        if (frame_count == 0 && !hooks_config.replay_fast) {
+            if (!started) offset = noh_get_monotonic_ns() - record.time;
+            if (!replay_wait(record.time + offset)) goto defer;
+        }
+        started = true;
 
-        // Fill in absolute axes if abs is supported.
-        if (test_bit(capabilities, cap_len, EV_ABS)) {
-            struct input_absinfo abs_feat;
-            uint8 *abs_map;
-            noh_arena_save(arena);
+        frame_device = record.device_index;
+        frame[frame_count++] = (Input_Event){ .type = record.type, .code = record.code, .value = record.value };
+        if ((record.type == EV_SYN && record.code == SYN_REPORT) || frame_count == HOOKS_EVENT_BATCH) {
+            if (!write_described_events(frame_device, frame, frame_count, replay_stop_fd)) goto defer;
+            frame_count = 0;
+        }
+    }
 
-            int abs_len = load_abs_map(arena, dev, &abs_map);
-            if (abs_len > 0) {
-                for (uint16 axis_id = 0; axis_id < ABS_MAX; axis_id++) {
-                    if (test_bit(abs_map, abs_len, axis_id)) {
-                        // This is a supported axis, get its state.
-                        if (load_axis_info(dev, axis_id, &abs_feat) >= 0) {
-                            // FUTURE: What are abs_feat.flat and abs_feat.fuzz?
-                            hooks_define_abs_axis(&state, dev, axis_id, &time, abs_feat.value, abs_feat.minimum, abs_feat.maximum);
-                        }
-                    }
-                }
-            }
+    write_described_events(frame_device, frame, frame_count, replay_stop_fd);
+    noh_log(NOH_INFO, "Replay finished.");
 
-            noh_arena_rewind(arena);
+defer:
+    pthread_exit(NULL);
+}
+
+// Starts the replay thread, after the devices were added by init_replay_devices.
+static bool start_replay() {
+    replay_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (replay_timer_fd < 0) {
+        noh_log(NOH_ERROR, "Could not create replay timer: %s", strerror(errno));
+        return false;
+    }
+
+    replay_stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (replay_stop_fd < 0) {
+        noh_log(NOH_ERROR, "Could not create replay eventfd: %s", strerror(errno));
+        close(replay_timer_fd);
+        replay_timer_fd = -1;
+        return false;
+    }
+
+    pthread_create(&replay_thread, NULL, replay, NULL);
+    return true;
+}
+
+// Stops the replay thread if it is running, and frees everything of the replay.
+static void stop_replay() {
+    if (replay_stop_fd >= 0) {
+        uint64_t wakeup = 1;
+        if (write(replay_stop_fd, &wakeup, sizeof(wakeup)) < 0) {
+            noh_log(NOH_WARNING, "Failed to stop the replay: %s", strerror(errno));
         }
+        pthread_join(replay_thread, NULL);
 
-        // Fill in relative axes if rel is supported.
-        if (test_bit(capabilities, cap_len, EV_REL)) {
-            uint8 *rel_map;
-            noh_arena_save(arena);
+        close(replay_stop_fd);
+        close(replay_timer_fd);
+        replay_stop_fd = -1;
+        replay_timer_fd = -1;
+    }
 
-            int rel_len = load_rel_map(arena, dev, &rel_map);
-            if (rel_len > 0) {
-                for (uint16 axis_id = 0; axis_id < REL_MAX; axis_id++) {
-                    if (test_bit(rel_map, rel_len, axis_id)) {
-                        hooks_define_rel_axis(&state, dev, axis_id, &time);
-                    }
-                }
-            }
+    free_described_devices();
 
-            noh_arena_rewind(arena);
+    if (replay_file != NULL) fclose(replay_file);
+    replay_file = NULL;
+}
+
+// The devices in the recording at hooks_config.replay_path.
+static const Hooks_Device_Source replay_source = {
+    .init_devices = init_replay_devices,
+    .query = described_device_query,
+    .start = start_replay,
+    .stop = stop_replay,
+    .hotplug = false
+};
+
+///////////////////////// Fake devices /////////////////////////
+
+// Fake devices have made up capabilities, and whatever events are written into them with fake_device_write. They make
+// it possible to test and benchmark the hooks without any hardware.
+
+typedef struct {
+    Hooks_Device_Description *elems;
+    size_t count;
+    size_t capacity;
+} Hooks_Device_Descriptions;
+
+// The fake devices that are created when the hooks are initialized with the fake source.
+static Hooks_Device_Descriptions fake_devices = {0};
+
+// Adds a fake device, which is created the next time the hooks are initialized with the fake source. Its index is
+// the number of fake devices that were added before it.
+void fake_device_define(const Hooks_Device_Description *description) {
+    noh_da_append(&fake_devices, *description);
+}
+
+// Removes all fake devices, and frees their descriptions.
+void fake_devices_clear() {
+    noh_da_free(&fake_devices);
+    fake_devices.elems = NULL;
+}
+
+// Writes events into the fake device with the specified index, timestamped with the current time. Waits while the
+// run thread is behind. Must only be called from one thread at a time per device.
+bool fake_device_write(size_t device_index, Input_Event *events, size_t count) {
+    noh_assert(device_index < fake_devices.count);
+    return write_described_events(device_index, events, count, -1);
+}
+
+// Creates all fake devices.
+static bool init_fake_devices(Noh_Arena *arena, NB_Input_Devices *devices) {
+    init_described_devices(devices);
+
+    for (size_t i = 0; i < fake_devices.count; i++) {
+        Hooks_Device_Description *described = noh_realloc_check(NULL, sizeof(Hooks_Device_Description));
+        *described = fake_devices.elems[i];
+
+        if (!add_described_device(arena, devices, devices->count, described)) {
+            free(described);
+            return false;
         }
     }
 
-    noh_arena_rewind(arena);
+    return true;
+}
 
-    return state;
+// The devices added with fake_device_define.
+static const Hooks_Device_Source fake_source = {
+    .init_devices = init_fake_devices,
+    .query = described_device_query,
+    .stop = free_described_devices,
+    .hotplug = false
+};
+
+// Creates the backend that was asked for, falling back to epoll if io_uring is not available, and starts the run
+// thread for it.
+static bool start_run_thread(NB_Input_Devices *devices, NB_Hooks_Backend backend) {
+    hooks_backend = NB_Backend_Epoll;
+    if (backend != NB_Backend_Epoll) {
+        hooks_backend = NB_Backend_Io_Uring;
+        if (create_uring(devices)) {
+            pthread_create(&run_thread, NULL, run_uring, NULL);
+            return true;
+        }
+
+        if (backend == NB_Backend_Io_Uring) return false;
+        hooks_backend = NB_Backend_Epoll;
+    }
+
+    if (!create_epoll(devices)) return false;
+    pthread_create(&run_thread, NULL, run, NULL);
+    return true;
 }
 
-// Creates a polfd struct with POLLIN for all the file descriptors of all devices.
-static struct pollfd *create_poll_fds(Noh_Arena *arena, NB_Input_Devices *devices) {
-    struct pollfd *poll_fds = noh_arena_alloc(arena, sizeof(struct pollfd) * devices->count);
-    for (size_t i = 0; i < devices->count; i++) {
-        NB_Input_Device *dev = &devices->elems[i];
-        struct pollfd poll_fd = { .fd = dev->fd, .events = POLLIN };
-        poll_fds[i] = poll_fd;
+// Reserves the snapshot buffers, if this was not done before.
+static bool init_snapshots() {
+    if (snapshots.capacity > 0) return true;
+
+    for (size_t i = 0; i < NBI_SNAPSHOT_BUFFERS; i++) {
+        void *data = mmap(NULL, HOOKS_SNAPSHOT_CAPACITY, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (data == MAP_FAILED) {
+            noh_log(NOH_ERROR, "Could not reserve snapshot buffer: %s", strerror(errno));
+            return false;
+        }
+
+        snapshots.buffers[i].data = data;
     }
 
-    return poll_fds;
+    snapshots.capacity = HOOKS_SNAPSHOT_CAPACITY;
+    return true;
 }
 
-bool hooks_initialize() {
+// Initializes the hooks with the devices of the specified source.
+static bool hooks_initialize_with_source(NB_Hooks_Config config, const Hooks_Device_Source *source) {
+    hooks_config = config;
+    hooks_source = source;
+
     noh_log(NOH_INFO, "Initializing hooks.");
+    lock_memory();
+    memset(&jitter, 0, sizeof(jitter));
 
     if (hooks_arena.blocks.count > 0) {
         noh_arena_reset(&hooks_arena);
@@ -492,41 +2950,110 @@ bool hooks_initialize() {
 
     // (Re)initialize the devices.
     memset(&hooks_devices, 0, sizeof(hooks_devices));
-    if (!init_devices(&hooks_arena, &hooks_devices)) {
+    if (!source->init_devices(&hooks_arena, &hooks_devices)) {
+        if (source->stop != NULL) source->stop();
         return false;
     }
     // The hooks arena now contains information about all devices.
 
+    // From here on, everything that was set up is undone in defer if anything fails.
+    bool result = true;
+    state_fd = -1;
+    state_timer_fd = -1;
+
     // Reset the input state to only the currently pressed values and axis offsets.
-    noh_arena_save(&hooks_arena);
-    pthread_mutex_lock(&input_mutex);
-    input_state = fill_current_state(&hooks_arena, &hooks_devices);
-    pthread_mutex_unlock(&input_mutex);
-    noh_arena_rewind(&hooks_arena);
+    hooks_free_state(&input_state);
+    input_state = fill_current_state(&hooks_devices);
+
+    if (!init_snapshots()) noh_return_defer(false);
+
+    if (change_fd < 0) change_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (change_fd < 0) {
+        noh_log(NOH_ERROR, "Could not create change eventfd: %s", strerror(errno));
+        noh_return_defer(false);
+    }
+
+    // Publish the initial state, so it is available before any input arrives.
+    if (!hooks_publish_snapshot(&snapshots, &input_state, 0)) {
+        noh_log(NOH_ERROR, "Input state does not fit in a snapshot buffer of %d bytes.", HOOKS_SNAPSHOT_CAPACITY);
+        noh_return_defer(false);
+    }
+    notify_change();
 
-    poll_fds = create_poll_fds(&hooks_arena, &hooks_devices);
-    // The hooks arena now also contains the poll_fds.
+    // Batches are only touched once a device is added, so this costs little until many devices are connected.
+    if (event_batches == NULL) event_batches = calloc(NBI_MAX_DEVICES, sizeof(Input_Event_Batch));
+    noh_assert(event_batches != NULL && "Could not allocate enough memory");
 
-    // Start running.
+    hooks_ring_initialize(&event_ring, HOOKS_RING_CAPACITY);
+
+    state_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (state_fd < 0) {
+        noh_log(NOH_ERROR, "Could not create state eventfd: %s", strerror(errno));
+        noh_return_defer(false);
+    }
+
+    state_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (state_timer_fd < 0) {
+        noh_log(NOH_ERROR, "Could not create state timer: %s", strerror(errno));
+        noh_return_defer(false);
+    }
+
+    if (config.record_path != NULL && !start_recording(&hooks_devices, config.record_path)) noh_return_defer(false);
+
+    // Start running. Devices that are not evdev devices are read with whichever backend is available.
     running = true;
-    pthread_create(&run_thread, NULL, run, NULL);
+    NB_Hooks_Backend backend = config.backend == NB_Backend_Replay ? NB_Backend_Auto : config.backend;
+    if (!start_run_thread(&hooks_devices, backend)) noh_return_defer(false);
+
+    // Start maintaining the state. Both threads run from here on, so hooks_shutdown can stop everything.
+    pthread_create(&state_thread, NULL, update_state, NULL);
 
-    // Start cleanup.
-    sem_init(&cleanup_sem, 0, 0);
-    pthread_create(&cleanup_thread, NULL, cleanup, NULL);
+    if (source->start != NULL && !source->start()) {
+        hooks_shutdown();
+        return false;
+    }
 
     return true;
+
+defer:
+    // No thread was started yet, so the devices are still ours to close.
+    running = false;
+    if (state_fd >= 0) close(state_fd);
+    if (state_timer_fd >= 0) close(state_timer_fd);
+    state_fd = -1;
+    state_timer_fd = -1;
+    stop_recording();
+    hooks_ring_free(&event_ring);
+    close_devices(&hooks_devices);
+    if (source->stop != NULL) source->stop();
+    noh_da_free(&hooks_devices);
+    unlock_memory();
+    return result;
+}
+
+bool hooks_initialize(NB_Hooks_Config config) {
+    return hooks_initialize_with_source(config, config.backend == NB_Backend_Replay ? &replay_source : &evdev_source);
+}
+
+// Initializes the hooks with the fake devices added with fake_device_define, instead of the devices in /dev/input.
+bool hooks_initialize_fake(NB_Hooks_Config config) {
+    return hooks_initialize_with_source(config, &fake_source);
 }
 
 bool hooks_reinitialize() {
     hooks_shutdown();
     noh_arena_reset(&hooks_arena);
-    return hooks_initialize();
+    return hooks_initialize_with_source(hooks_config, hooks_source);
 }
 
 NB_Input_State hooks_get_state(Noh_Arena *arena) {
-    pthread_mutex_lock(&input_mutex);
-    NB_Input_State result = copy_nbi_state_to_nb_state(arena, &input_state);
-    pthread_mutex_unlock(&input_mutex);
-    return result;
+    return hooks_read_snapshot(&snapshots, arena);
+}
+
+uint64 hooks_get_generation() {
+    return hooks_snapshot_generation(&snapshots);
+}
+
+int hooks_get_change_fd() {
+    return change_fd;
 }
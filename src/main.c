@@ -6,10 +6,18 @@
 // should not be included wherever UI code is written, the hooking subsystem can use it for its own logic, but it
 // just exposes the pressed keys as numeric values that should be given meaning through keyboard files.
 
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
 #define NOH_IMPLEMENTATION
 #include "noh.h"
 #include "hooks.h"
 
+// Raylib is built on GLFW, which can wake up the thread that waits for window events from any other thread.
+void glfwPostEmptyEvent(void);
+
 // An input event from a /dev/input file stream.
 typedef struct {
     struct timeval time;
@@ -25,10 +33,75 @@ typedef enum {
     NB_MainMenu
 } NB_View;
 
+// The width of a bucket of the latency histogram, in microseconds.
+#define NB_LATENCY_BUCKET_US 100
+
+// The number of buckets in the latency histogram, latencies beyond the last bucket are counted in the last bucket.
+#define NB_LATENCY_BUCKETS 2000
+
+// The file the latency histogram is written to.
+#define NB_LATENCY_FILE "./latency.csv"
+
+// A histogram of the time between input events happening and the end of drawing the first frame that shows them.
+typedef struct {
+    uint32 buckets[NB_LATENCY_BUCKETS];
+    size_t count; // The number of latencies recorded.
+    int64 max; // The highest latency recorded, in nanoseconds.
+} NB_Latency_Stats;
+
+// The number of frames drawn per second at most.
+#define NB_TARGET_FPS 60
+
+// The width of a bucket of the frame time histogram, in microseconds.
+#define NB_FRAME_TIME_BUCKET_US 50
+
+// The number of buckets in the frame time histogram, longer frame times are counted in the last bucket.
+#define NB_FRAME_TIME_BUCKETS 2000
+
+// Polling for window events that takes longer than this, in microseconds, waited for an event instead of only
+// collecting the events that were already there.
+#define NB_EVENT_WAIT_US 1000
+
+// With late latching, the input is read this long before the end of the frame, in microseconds, on top of the time
+// reading and drawing it took recently. Absorbs a frame that takes a bit longer than the ones before it.
+#define NB_LATCH_MARGIN_US 500
+
+// How the time between frames is kept.
+typedef enum {
+    NB_Pacing_Deadline, // Sleep until an absolute deadline for every frame, the CPU is idle while waiting.
+    NB_Pacing_Raylib // Wait with WaitTime of raylib, like EndDrawing does by default, which spins for part of the wait.
+} NB_Pacing;
+
+// Keeps frames at a fixed period by sleeping until an absolute deadline, so the time spent drawing and any lateness of
+// waking up do not add up over the frames.
+typedef struct {
+    int64 period; // The time between frames in nanoseconds.
+    int64 deadline; // The monotonic time in nanoseconds at which the next frame starts, 0 before the first frame.
+
+    // With late latching, how long before the deadline the input is read, so that the frame is shown at the deadline.
+    int64 latch_lead;
+} NB_Frame_Pacer;
+
+// A histogram of the time between the starts of consecutive frames without a wait for events in between, and the CPU
+// time used by the whole process.
+typedef struct {
+    uint32 buckets[NB_FRAME_TIME_BUCKETS];
+    size_t count; // The number of frame times recorded.
+    int64 max; // The longest frame time recorded, in nanoseconds.
+
+    int64 last_frame_at; // The monotonic time in nanoseconds at which the last frame started, 0 before the first.
+    int64 started_at; // The monotonic time in nanoseconds at which recording started.
+    int64 start_cpu; // The CPU time of the process in nanoseconds when recording started.
+} NB_Frame_Stats;
+
 typedef struct {
     Vector2 screen_size;
     NB_View view;
     bool running;
+
+    bool show_latency; // Whether the latency overlay is shown.
+    NB_Latency_Stats latency;
+    NB_Frame_Stats frames;
 } NB_State;
 
 typedef enum {
@@ -85,6 +158,187 @@ void calculate_text_bounds(char *text, Font font, float *font_size, NB_Align ali
     }
 }
 
+// Records the latency of an input state once it has been drawn, if this is the first frame that shows it.
+void record_latency(NB_Latency_Stats *stats, NB_Input_State *input_state, int64 drawn_at) {
+    if (input_state->input_time == 0) return; // Nothing new from the devices since the previous frame.
+
+    int64 latency = drawn_at - input_state->input_time;
+    if (latency < 0) latency = 0;
+
+    size_t bucket = latency / (NB_LATENCY_BUCKET_US * 1000);
+    if (bucket >= NB_LATENCY_BUCKETS) bucket = NB_LATENCY_BUCKETS - 1;
+    stats->buckets[bucket]++;
+    stats->count++;
+    if (latency > stats->max) stats->max = latency;
+}
+
+// Returns the latency in milliseconds below which the specified fraction of the recorded latencies lie. Is accurate
+// up to the width of a bucket.
+double latency_percentile(NB_Latency_Stats *stats, double fraction) {
+    if (stats->count == 0) return 0;
+
+    size_t target = (size_t)ceil(stats->count * fraction);
+    size_t seen = 0;
+    for (size_t i = 0; i < NB_LATENCY_BUCKETS; i++) {
+        seen += stats->buckets[i];
+        if (seen >= target) return (double)(i + 1) * NB_LATENCY_BUCKET_US / 1000;
+    }
+    return (double)NB_LATENCY_BUCKETS * NB_LATENCY_BUCKET_US / 1000;
+}
+
+// Writes the percentiles and all non-empty buckets of the latency histogram to a file.
+bool dump_latency(NB_Latency_Stats *stats, const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        noh_log(NOH_ERROR, "Could not open %s for writing: %s", path, strerror(errno));
+        return false;
+    }
+
+    fprintf(file, "# count %zu, p50 %.1f ms, p95 %.1f ms, p99 %.1f ms, max %.1f ms\n", stats->count,
+            latency_percentile(stats, .50), latency_percentile(stats, .95), latency_percentile(stats, .99),
+            (double)stats->max / 1000 / 1000);
+    fprintf(file, "bucket_start_ms,bucket_end_ms,count\n");
+    for (size_t i = 0; i < NB_LATENCY_BUCKETS; i++) {
+        if (stats->buckets[i] == 0) continue;
+        fprintf(file, "%.1f,%.1f,%u\n", (double)i * NB_LATENCY_BUCKET_US / 1000,
+                (double)(i + 1) * NB_LATENCY_BUCKET_US / 1000, stats->buckets[i]);
+    }
+
+    fclose(file);
+    noh_log(NOH_INFO, "Wrote latency histogram of %zu frames to %s.", stats->count, path);
+    return true;
+}
+
+///////////////////////// Frame pacing /////////////////////////
+
+// Returns the CPU time used by all threads of the process so far, in nanoseconds.
+int64 process_cpu_time() {
+    struct timespec time;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time) < 0) return 0;
+    return (int64)time.tv_sec * 1000 * 1000 * 1000 + time.tv_nsec;
+}
+
+// Sleeps until the specified time before the next deadline. Every deadline is one period after the previous one, so
+// oversleeping one frame is made up for in the next. If the previous frame was more than a period late, like after
+// waiting for input, the deadlines start over from now instead of rushing through the missed frames: this frame
+// continues right away, and the next one no sooner than a period later.
+void pace_frame(NB_Frame_Pacer *pacer, int64 lead) {
+    int64 now = noh_get_monotonic_ns();
+    if (pacer->deadline == 0 || now - (pacer->deadline - lead) > pacer->period) {
+        pacer->deadline = now + lead + pacer->period;
+        return;
+    }
+
+    int64 wake_at = pacer->deadline - lead;
+    struct timespec until = {
+        .tv_sec = wake_at / (1000 * 1000 * 1000),
+        .tv_nsec = wake_at % (1000 * 1000 * 1000)
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR);
+    pacer->deadline += pacer->period;
+}
+
+// Updates how long before the deadline the input is read with late latching, from the time reading and drawing the
+// input and swapping the frame took. Grows right away when that took longer, and shrinks slowly when it took less.
+void update_latch_lead(NB_Frame_Pacer *pacer, int64 took) {
+    int64 lead = took + NB_LATCH_MARGIN_US * 1000;
+    if (lead > pacer->period) lead = pacer->period;
+
+    if (lead > pacer->latch_lead) pacer->latch_lead = lead;
+    else pacer->latch_lead -= (pacer->latch_lead - lead) / 16;
+}
+
+// Records the start of a frame, and the time since the start of the previous frame. If the loop waited for an event
+// since the previous frame, that time is an idle gap rather than a frame time, and it is not recorded.
+void record_frame(NB_Frame_Stats *stats, int64 started_at, bool waited) {
+    if (stats->started_at == 0) {
+        stats->started_at = started_at;
+        stats->start_cpu = process_cpu_time();
+    }
+
+    if (stats->last_frame_at != 0 && !waited) {
+        int64 frame_time = started_at - stats->last_frame_at;
+        size_t bucket = frame_time / (NB_FRAME_TIME_BUCKET_US * 1000);
+        if (bucket >= NB_FRAME_TIME_BUCKETS) bucket = NB_FRAME_TIME_BUCKETS - 1;
+        stats->buckets[bucket]++;
+        stats->count++;
+        if (frame_time > stats->max) stats->max = frame_time;
+    }
+    stats->last_frame_at = started_at;
+}
+
+// Returns the frame time in milliseconds below which the specified fraction of the recorded frame times lie. Is
+// accurate up to the width of a bucket.
+double frame_time_percentile(NB_Frame_Stats *stats, double fraction) {
+    if (stats->count == 0) return 0;
+
+    size_t target = (size_t)ceil(stats->count * fraction);
+    size_t seen = 0;
+    for (size_t i = 0; i < NB_FRAME_TIME_BUCKETS; i++) {
+        seen += stats->buckets[i];
+        if (seen >= target) return (double)(i + 1) * NB_FRAME_TIME_BUCKET_US / 1000;
+    }
+    return (double)NB_FRAME_TIME_BUCKETS * NB_FRAME_TIME_BUCKET_US / 1000;
+}
+
+// Returns the percentage of a single CPU the process used since recording started.
+double frame_cpu_usage(NB_Frame_Stats *stats) {
+    int64 elapsed = noh_get_monotonic_ns() - stats->started_at;
+    if (stats->started_at == 0 || elapsed <= 0) return 0;
+    return (double)(process_cpu_time() - stats->start_cpu) / elapsed * 100;
+}
+
+// Returns a description of the frame times and CPU usage, allocated in the arena.
+char *describe_frames(Noh_Arena *arena, NB_Frame_Stats *stats) {
+    return noh_arena_sprintf(arena, "frame time p50 %.2f | p99 %.2f | max %.2f ms (%zu), CPU %.1f%%",
+            frame_time_percentile(stats, .50), frame_time_percentile(stats, .99), (double)stats->max / 1000 / 1000,
+            stats->count, frame_cpu_usage(stats));
+}
+
+// Draws the latency percentiles, and the frame times below them, in the top right corner of the screen.
+void render_latency(Noh_Arena *arena, NB_State *state) {
+    NB_Latency_Stats *stats = &state->latency;
+    char *text = noh_arena_sprintf(arena, "latency p50 %.1f | p95 %.1f | p99 %.1f | max %.1f ms (%zu)",
+            latency_percentile(stats, .50), latency_percentile(stats, .95), latency_percentile(stats, .99),
+            (double)stats->max / 1000 / 1000, stats->count);
+
+    int font_size = 20;
+    Vector2 text_size = MeasureTextEx(nb_font, text, font_size, 0);
+    Vector2 pos = { .x = state->screen_size.x - text_size.x - 10, .y = 10 };
+    DrawTextEx(nb_font, text, pos, font_size, 0, YELLOW);
+
+    text = describe_frames(arena, &state->frames);
+    text_size = MeasureTextEx(nb_font, text, font_size, 0);
+    pos = (Vector2){ .x = state->screen_size.x - text_size.x - 10, .y = pos.y + text_size.y + 4 };
+    DrawTextEx(nb_font, text, pos, font_size, 0, YELLOW);
+}
+
+// Waits for the input state to change, and wakes up the main loop whenever it does, so it draws the new state right
+// away instead of waiting for the next window event. Stops once the eventfd passed as argument becomes readable.
+void *wake_on_input(void *arg) {
+    int stop_fd = *(int *)arg;
+    struct pollfd fds[] = {
+        { .fd = hooks_get_change_fd(), .events = POLLIN },
+        { .fd = stop_fd, .events = POLLIN },
+    };
+
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+
+            noh_log(NOH_ERROR, "Unable to wait for input changes: %s", strerror(errno));
+            return NULL;
+        }
+        if (fds[1].revents & POLLIN) return NULL;
+
+        uint64_t counter;
+        if (read(fds[0].fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN) {
+            noh_log(NOH_WARNING, "Failed to consume input change: %s", strerror(errno));
+        }
+        glfwPostEmptyEvent();
+    }
+}
+
 bool render_button(char *text, Vector2 position, Vector2 size) {
     Rectangle rec = rec_from_vec2s(position, size);
     bool hover = CheckCollisionPointRec(GetMousePosition(), rec);
@@ -140,7 +394,8 @@ void show_keyboard(Noh_Arena *arena, NB_State *state, NB_Input_State *input_stat
             if (dev == NULL) continue;
 
             noh_string_append_cstr(&str, dev->name);
-            noh_string_append_cstr(&str, ": ");
+            char *kps_str = noh_arena_sprintf(arena, " [%u kps]: ", list->keys_per_second);
+            noh_string_append_cstr(&str, kps_str);
             for (size_t i = 0; i < list->count; i++) {
                 uint16 key = list->elems[i];
                 char *keyStr = noh_arena_sprintf(arena, "%hu", key);
@@ -229,17 +484,132 @@ void main_menu(Noh_Arena *arena, NB_State *state) {
     if (render_button("Quit", pos, size)) state->running = false;
 }
 
-int main(void)
+// Draws the parts of a view that do not depend on the input state.
+void draw_view_static(Noh_Arena *arena, NB_State *state, NB_View view) {
+    switch (view) {
+        case NB_MainMenu:
+            main_menu(arena, state);
+            break;
+
+        case NB_ShowKeyboard:
+            // Everything shown on the keyboard view depends on the input state.
+            break;
+
+        default:
+            noh_assert(false && "Invalid view.");
+            break;
+    }
+}
+
+// Draws the parts of a view that show the input state.
+void draw_view_input(Noh_Arena *arena, NB_State *state, NB_View view, NB_Input_State *input_state) {
+    switch (view) {
+        case NB_MainMenu:
+            break;
+
+        case NB_ShowKeyboard:
+            show_keyboard(arena, state, input_state);
+            break;
+
+        default:
+            noh_assert(false && "Invalid view.");
+            break;
+    }
+}
+
+void print_usage(char *program) {
+    noh_log(NOH_INFO, "Usage: %s [options]", program);
+    noh_log(NOH_INFO, "Options:");
+    noh_log(NOH_INFO, "    --record <file>    Record all input to the file.");
+    noh_log(NOH_INFO, "    --replay <file>    Show the input recorded in the file, instead of the input of the devices.");
+    noh_log(NOH_INFO, "    --replay-fast      Replay as fast as possible, instead of with the timing of the recording.");
+    noh_log(NOH_INFO, "    --realtime <fifo|rr> [priority]");
+    noh_log(NOH_INFO, "                       Read the devices in a real-time thread, optionally with a priority of 1-99.");
+    noh_log(NOH_INFO, "    --run-cpus <mask>  Only read the devices on the CPUs in the mask, like 0x4 for CPU 2.");
+    noh_log(NOH_INFO, "    --state-cpus <mask>");
+    noh_log(NOH_INFO, "                       Only apply the input to the state on the CPUs in the mask.");
+    noh_log(NOH_INFO, "    --lock-memory      Keep all memory of NohBoard in RAM.");
+    noh_log(NOH_INFO, "    --continuous       Draw every frame, instead of only when the input or the window changes.");
+    noh_log(NOH_INFO, "    --pacing <deadline|raylib>");
+    noh_log(NOH_INFO, "                       Sleep until a deadline for every frame, the default, or use the wait of");
+    noh_log(NOH_INFO, "                       raylib, which spins the CPU for part of every frame.");
+    noh_log(NOH_INFO, "    --late-latch       Draw everything that does not show the input before waiting for the next");
+    noh_log(NOH_INFO, "                       frame, and only get the input state just in time to draw the rest and");
+    noh_log(NOH_INFO, "                       show the frame at the end of its period.");
+}
+
+// Parses a mask of CPUs, in decimal or hexadecimal with 0x. Returns false if it is not valid.
+bool parse_cpus(const char *value, uint64 *cpus) {
+    char *end;
+    errno = 0;
+    *cpus = strtoull(value, &end, 0);
+    return errno == 0 && *end == '\0' && end != value;
+}
+
+int main(int argc, char **argv)
 {
+    // Startup time is measured up to the first frame, since that is when NohBoard becomes useful.
+    int64 started_at = noh_get_monotonic_ns();
+
+    char *program = noh_shift_args(&argc, &argv);
+    NB_Hooks_Config hooks_config = { .backend = NB_Backend_Auto };
+    bool continuous = false;
+    NB_Pacing pacing = NB_Pacing_Deadline;
+    bool late_latch = false;
+    while (argc > 0) {
+        char *arg = noh_shift_args(&argc, &argv);
+        if (strcmp(arg, "--record") == 0 && argc > 0) {
+            hooks_config.record_path = noh_shift_args(&argc, &argv);
+        } else if (strcmp(arg, "--replay") == 0 && argc > 0) {
+            hooks_config.backend = NB_Backend_Replay;
+            hooks_config.replay_path = noh_shift_args(&argc, &argv);
+        } else if (strcmp(arg, "--replay-fast") == 0) {
+            hooks_config.replay_fast = true;
+        } else if (strcmp(arg, "--realtime") == 0 && argc > 0) {
+            char *policy = noh_shift_args(&argc, &argv);
+            if (strcmp(policy, "fifo") == 0) {
+                hooks_config.run_scheduling = NB_Scheduling_Fifo;
+            } else if (strcmp(policy, "rr") == 0) {
+                hooks_config.run_scheduling = NB_Scheduling_Round_Robin;
+            } else {
+                print_usage(program);
+                return 1;
+            }
+
+            // The priority is optional, the lowest real-time priority is enough to go ahead of the rest.
+            if (argc > 0 && atoi(argv[0]) > 0) hooks_config.run_priority = atoi(noh_shift_args(&argc, &argv));
+        } else if (strcmp(arg, "--run-cpus") == 0 && argc > 0 && parse_cpus(argv[0], &hooks_config.run_cpus)) {
+            noh_shift_args(&argc, &argv);
+        } else if (strcmp(arg, "--state-cpus") == 0 && argc > 0 && parse_cpus(argv[0], &hooks_config.state_cpus)) {
+            noh_shift_args(&argc, &argv);
+        } else if (strcmp(arg, "--lock-memory") == 0) {
+            hooks_config.lock_memory = true;
+        } else if (strcmp(arg, "--continuous") == 0) {
+            continuous = true;
+        } else if (strcmp(arg, "--pacing") == 0 && argc > 0 && strcmp(argv[0], "deadline") == 0) {
+            noh_shift_args(&argc, &argv);
+            pacing = NB_Pacing_Deadline;
+        } else if (strcmp(arg, "--pacing") == 0 && argc > 0 && strcmp(argv[0], "raylib") == 0) {
+            noh_shift_args(&argc, &argv);
+            pacing = NB_Pacing_Raylib;
+        } else if (strcmp(arg, "--late-latch") == 0) {
+            late_latch = true;
+        } else {
+            print_usage(program);
+            return 1;
+        }
+    }
+
     Noh_Arena arena = noh_arena_init(10 KB);
 
     // Initial state.
     NB_State state = { .screen_size = { .x = 800, .y = 600 }, .view = NB_MainMenu, .running = true };
 
-    if (!hooks_initialize()) {
+    if (!hooks_initialize(hooks_config)) {
         noh_log(NOH_ERROR, "Unable to initialize hooks, exiting.");
         return 1;
     }
+    int64 hooks_initialized_at = noh_get_monotonic_ns();
 
     SetTraceLogLevel(LOG_WARNING); 
     InitWindow(state.screen_size.x, state.screen_size.y, "NohBoard");
@@ -250,10 +620,50 @@ int main(void)
 
     Noh_String str = {0};
 
-    SetTargetFPS(60);
+    // Only draw when something changed: the window waits for its own events, and the waker thread posts one whenever
+    // the input state changes. Decaying axes change the input state too, so there are no other deadlines to wake up
+    // for. The pacer still limits how often a stream of changes is drawn.
+    NB_Frame_Pacer pacer = { .period = 1000 * 1000 * 1000 / NB_TARGET_FPS };
+    int waker_stop_fd = -1;
+    pthread_t waker_thread;
+    if (!continuous) {
+        waker_stop_fd = eventfd(0, EFD_CLOEXEC);
+        if (waker_stop_fd < 0) {
+            noh_log(NOH_WARNING, "Could not create eventfd, drawing every frame: %s", strerror(errno));
+        } else {
+            pthread_create(&waker_thread, NULL, wake_on_input, &waker_stop_fd);
+            EnableEventWaiting();
+        }
+    }
+
+    bool first_frame = true;
+    bool waited = false; // Whether polling waited for an event after the previous frame.
     while (!WindowShouldClose() && state.running)
     {
+        // The view is only switched between frames, so both halves of the frame draw the same view.
+        NB_View view = state.view;
+
+        // Sleep before getting the input state rather than after drawing, so the frame shows the latest input. With
+        // late latching, the parts that do not depend on the input are drawn before sleeping as well, and the input is
+        // read only as long before the end of the frame as reading and drawing it takes.
+        int64 frame_started_at = noh_get_monotonic_ns();
+        if (!late_latch) {
+            if (pacing == NB_Pacing_Deadline) pace_frame(&pacer, 0);
+            record_frame(&state.frames, noh_get_monotonic_ns(), waited);
+        }
+
         noh_arena_save(&arena);
+        BeginDrawing();
+        ClearBackground(BLACK);
+        draw_view_static(&arena, &state, view);
+
+        if (late_latch) {
+            if (pacing == NB_Pacing_Deadline) pace_frame(&pacer, pacer.latch_lead);
+            else WaitTime((pacer.period - pacer.latch_lead - (noh_get_monotonic_ns() - frame_started_at)) / 1e9);
+            record_frame(&state.frames, noh_get_monotonic_ns(), waited);
+        }
+
+        int64 latched_at = noh_get_monotonic_ns();
         NB_Input_State input_state = hooks_get_state(&arena);
 
 #ifdef NB_DEBUG_KEYPRESSES
@@ -263,30 +673,55 @@ int main(void)
         }
 #endif
 
-        BeginDrawing();
-        ClearBackground(BLACK);
-        switch (state.view) {
-            case NB_MainMenu:
-                main_menu(&arena, &state);
-                break;
+        draw_view_input(&arena, &state, view, &input_state);
 
-            case NB_ShowKeyboard:
-                show_keyboard(&arena, &state, &input_state);
-                break;
-
-            default:
-                noh_assert(false && "Invalid view.");
-                break;
-        }
+        // F11 toggles the latency overlay, F9 writes the latency histogram to a file. Not F12, raylib takes a screenshot
+        // on that, and F10 leaves the keyboard view. The overlay goes on top of everything, so it is drawn last.
+        if (IsKeyPressed(KEY_F11)) state.show_latency = !state.show_latency;
+        if (IsKeyPressed(KEY_F9)) dump_latency(&state.latency, NB_LATENCY_FILE);
+        if (state.show_latency) render_latency(&arena, &state);
 
+        // Raylib is built with SUPPORT_CUSTOM_FRAME_CONTROL, so EndDrawing only draws. Swapping, waiting for the next
+        // frame and polling for events happen here, so the time the frame is shown is taken before polling waits for
+        // the next event.
         EndDrawing();
+        SwapScreenBuffer();
+
+        // The frame is on its way to the screen, this is as close to the photons as we can measure.
+        int64 shown_at = noh_get_monotonic_ns();
+        record_latency(&state.latency, &input_state, shown_at);
+        if (late_latch) update_latch_lead(&pacer, shown_at - latched_at);
+
+        if (first_frame) {
+            noh_log(NOH_INFO, "First frame shown %.1f ms after starting, of which %.1f ms initializing the hooks.",
+                    (shown_at - started_at) / 1e6, (hooks_initialized_at - started_at) / 1e6);
+            first_frame = false;
+        }
 
         noh_arena_rewind(&arena);
+
+        // Like EndDrawing does with a target FPS: wait for whatever is left of the frame, partly spinning. With late
+        // latching, this wait happened before reading the input.
+        if (pacing == NB_Pacing_Raylib && !late_latch) WaitTime((pacer.period - (shown_at - frame_started_at)) / 1e9);
+        int64 poll_started_at = noh_get_monotonic_ns();
+        PollInputEvents();
+        waited = noh_get_monotonic_ns() - poll_started_at > NB_EVENT_WAIT_US * 1000;
     }
 
+    noh_log(NOH_INFO, "%s with %s pacing.", describe_frames(&arena, &state.frames),
+            pacing == NB_Pacing_Deadline ? "deadline" : "raylib");
+
     noh_arena_free(&arena);
     noh_string_free(&str);
 
+    // The waker must be done posting events before the window is closed.
+    if (waker_stop_fd >= 0) {
+        uint64_t stop = 1;
+        (void)!write(waker_stop_fd, &stop, sizeof(stop));
+        pthread_join(waker_thread, NULL);
+        close(waker_stop_fd);
+    }
+
     hooks_shutdown();
 
     CloseWindow();
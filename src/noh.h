@@ -36,6 +36,14 @@
 #define uint unsigned int
 #endif
 
+#ifndef int32
+#define int32 int
+#endif
+
+#ifndef uint32
+#define uint32 unsigned int
+#endif
+
 #ifndef int64
 #define int64 long
 #endif
@@ -84,6 +92,17 @@ char *noh_shift_args(int *argc, char ***argv);
 // needed, and cannot really be expected to be reliable.
 long noh_diff_timespec_ms(const struct timespec *time1, const struct timespec *time2);
 
+// Returns the result of subtracting the second timespec from the first timespec, in nanoseconds.
+// Only meaningful for timespecs from a clock that does not jump, such as those from noh_get_monotonic_time.
+int64 noh_diff_timespec_ns(const struct timespec *time1, const struct timespec *time2);
+
+// Returns a timespec that represents the current time of the monotonic clock. This clock has no relation to the
+// local time, but is never adjusted, so it is the one to use for measuring durations.
+struct timespec noh_get_monotonic_time();
+
+// Returns the current time of the monotonic clock in nanoseconds.
+int64 noh_get_monotonic_ns();
+
 // Returns a timespec that represents the local time with the specified number of second and milliseconds added.
 // Negative values will lead to a time in the past.
 struct timespec noh_get_time_in(int seconds, long milliseconds);
@@ -410,6 +429,29 @@ long noh_diff_timespec_ms(const struct timespec *time1, const struct timespec *t
     return res;
 }
 
+int64 noh_diff_timespec_ns(const struct timespec *time1, const struct timespec *time2) {
+    noh_assert(time1);
+    noh_assert(time2);
+
+    return (int64)(time1->tv_sec - time2->tv_sec) * 1000 * 1000 * 1000 + (time1->tv_nsec - time2->tv_nsec);
+}
+
+struct timespec noh_get_monotonic_time() {
+    struct timespec time;
+    if (clock_gettime(CLOCK_MONOTONIC, &time) == -1)
+    {
+        noh_log(NOH_ERROR, "Unable to get the current time: %s", strerror(errno));
+        exit(1);
+    }
+
+    return time;
+}
+
+int64 noh_get_monotonic_ns() {
+    struct timespec time = noh_get_monotonic_time();
+    return (int64)time.tv_sec * 1000 * 1000 * 1000 + time.tv_nsec;
+}
+
 struct timespec noh_get_time_in(int seconds, long milliseconds) {
     struct timespec time;
     if (clock_gettime(CLOCK_REALTIME, &time) == -1)